@@ -113,14 +113,17 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Up to 16 invalidations can be queued on a cpu; further senders wait
+ * for it to drain the queue. The sender of a batch asks for an ack on
+ * its last one only, since a cpu handles its queue in order.
  */
 
+struct tlbshootdown_wait;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	pid_t ts_pid;				/* Process the page belongs to */
+	vaddr_t ts_vaddr;			/* Page to drop from the TLB */
+	struct tlbshootdown_wait *ts_wait;	/* Acked when done, or NULL */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -35,6 +35,7 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <addrspace.h>
 
 
 /*
@@ -128,6 +129,14 @@ syscall(struct trapframe *tf)
 		case SYS__exit:
 		sys__exit((int)tf->tf_a0);
 		break;
+		
+		case SYS_fork:
+		err = sys_fork(tf, &retval);
+		break;
+		
+		case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
 
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -167,13 +176,22 @@ syscall(struct trapframe *tf)
 /*
  * Enter user mode for a newly forked process.
  *
- * This function is provided as a reminder. You need to write
- * both it and the code that calls it.
- *
- * Thus, you can trash it and do things another way if you prefer.
+ * tf is a copy of the parent's trapframe on the heap, made by sys_fork:
+ * it is moved to our stack, then fork returns 0 in the child.
  */
 void
 enter_forked_process(struct trapframe *tf)
 {
-	(void)tf;
+	struct trapframe child_tf;
+
+	child_tf = *tf;
+	kfree(tf);
+
+	child_tf.tf_v0 = 0;
+	child_tf.tf_a3 = 0;
+	child_tf.tf_epc += 4;
+
+	as_activate();
+
+	mips_usermode(&child_tf);
 }
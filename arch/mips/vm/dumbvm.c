@@ -384,10 +384,12 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 }
 
 int
-as_copy(struct addrspace *old, struct addrspace **ret)
+as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 {
 	struct addrspace *new;
 
+	(void)pid;
+
 	dumbvm_can_sleep();
 
 	new = as_create();
@@ -39,8 +39,38 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct cow;
+struct textcache;
 
 
+#if !OPT_DUMBVM
+/*
+ * A segment of the address space: the pages between vbase and vtop, the
+ * first filesize bytes read from v at offset and the rest zero-filled.
+ * Segments without a file (the stack) are all zero-filled.
+ */
+struct region {
+	vaddr_t vbase; // start, as in the ELF file (not page aligned)
+	vaddr_t vtop; // end, page aligned
+	off_t offset;
+	size_t filesize;
+	struct vnode *v; // NULL if none
+	int flags; // REGION_*
+	
+	// pages shared with the processes running the same file, only for
+	// read-only segments of a file
+	struct textcache *text;
+};
+
+#define REGION_READ 0x1
+#define REGION_WRITE 0x2
+#define REGION_EXEC 0x4
+#define REGION_HEAP 0x8 // grown and shrunk by sbrk
+
+// segments of an ELF file plus the stack
+#define AS_MAX_REGIONS 8
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -58,20 +88,30 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        // text
-		vaddr_t text_vbase;
-        size_t text_npages;
-        off_t text_offset;
-        size_t text_size;
+		// segments, sorted by address
+		struct region regions[AS_MAX_REGIONS];
+		int nregions;
+		
+		// heap segment (-1 if none) and its end, as seen by sbrk
+		int heap;
+		vaddr_t heap_end;
+		
+		// lowest top of the heap since the last fork: the heap pages above
+		// it were given back and grown again, none of them is shared
+		vaddr_t heap_cow_top;
+		
+		// last page loaded from the ELF file, to detect sequential faults
+		vaddr_t last_fault;
+		
+		// software ASID, never reused, tells whose translations are in a TLB
+		unsigned asid;
 		
-		// data
-        vaddr_t data_vbase;
-        size_t data_npages;
-        off_t data_offset;
-        size_t data_size;
+		// pages shared copy-on-write with other address spaces, NULL if none
+		struct cow *cow;
 		
-		// elf node
-		struct vnode *v;
+		// owner of its own pages in the IPT and in the swapfile, the pid
+		// of the process it belongs to (-1 if none)
+		pid_t pid;
 #endif
 };
 
@@ -84,9 +124,9 @@ struct addrspace {
  *                return NULL on out-of-memory error.
  *
  *    as_copy   - create a new address space that is an exact copy of
- *                an old one. Probably calls as_create to get a new
- *                empty address space and fill it in, but that's up to
- *                you.
+ *                an old one, for the process pid. Probably calls
+ *                as_create to get a new empty address space and fill
+ *                it in, but that's up to you.
  *
  *    as_activate - make curproc's address space the one currently
  *                "seen" by the processor.
@@ -117,7 +157,7 @@ struct addrspace {
  */
 
 struct addrspace *as_create(void);
-int               as_copy(struct addrspace *src, struct addrspace **ret);
+int               as_copy(struct addrspace *src, struct addrspace **ret, pid_t pid);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
@@ -135,6 +175,10 @@ int               as_define_stack(struct addrspace *as, vaddr_t *stackptr);
 void 			  vm_can_sleep(void);
 void			  as_zero_region(paddr_t paddr, unsigned npages);
 int 			  load_page_on_demand(struct vnode* v, paddr_t paddr, size_t memsize, size_t filesize, off_t offset);
+int 			  vm_set_faultaround(int npages);
+int 			  vm_set_stack_limit(int npages);
+int 			  as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *old_end);
+int 			  as_copy_eager(struct addrspace *old, struct addrspace **ret, pid_t pid);
 
 /*
  * Functions in loadelf.c
@@ -3,10 +3,60 @@
 
 #include <types.h>
 
-int isTableActive(void); 
+/*
+ * One descriptor for each physical frame, shared by the frame allocator
+ * and the inverted page table. 16 bytes, four of them in a cache line:
+ * frame indices fit in 16 bits (sys161 has less than 128 MB of RAM).
+ * Which fields mean something depends on the kind of frame:
+ * - free: next/prev link the free blocks of the buddy allocator and
+ *   order is the order of the block starting here (-1 if none);
+ * - kernel: prev is the number of frames allocated from here (first
+ *   frame of the allocation);
+ * - user: pid and vaddr of the page it holds, next links the hash chain
+ *   of the IPT, owner_next/owner_prev the frames of its owner (see pt.c),
+ *   pins counts the faults that keep it in memory.
+ */
+struct frame
+{
+	vaddr_t vaddr;
+	int16_t next;
+	int16_t prev;
+	int16_t owner_next;
+	int16_t owner_prev;
+	int16_t pid; // -1 if not a user frame
+	uint8_t state; // kind of frame and its flags
+	union {
+		int8_t order;
+		uint8_t pins;
+	};
+};
+
+// kind of frame, in the low bits of state
+#define FRAME_FREE 0
+#define FRAME_KERNEL 1
+#define FRAME_USER 2
+#define FRAME_KIND 0x03
+
+// flags of a user frame
+#define FRAME_REF 0x04 // referenced since the clock hand last passed
+#define FRAME_DIRTY 0x08 // written since it was loaded, must be saved on eviction
+#define FRAME_BUSY 0x10 // being evicted, can't be picked as a victim nor mapped
+#define FRAME_SPEC_SHIFT 5 // loaded speculatively and not used yet (PT_SPEC_*)
+#define FRAME_SPEC (0x3 << FRAME_SPEC_SHIFT)
+
+#define FRAME_IS(f, kind) (((f)->state & FRAME_KIND) == (kind))
+
+extern struct frame *frameTable;
+
+int isTableActive(void);
 void coremap_bootstrap(void);
 paddr_t getppages(unsigned long npages);
 paddr_t getfreeppages(unsigned long npages);
+paddr_t getuserppage(void);
+paddr_t getzeroedppage(void);
+int coremap_zero_start(void);
 int freeppages(paddr_t addr);
+int coremap_get_nfree(void);
+void coremap_get_usage(int *nkernel, int *nuser, int *nfree);
 
-#endif // _COREMAP_H_ 
+#endif // _COREMAP_H_
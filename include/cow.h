@@ -0,0 +1,35 @@
+#ifndef _COW_H_
+#define _COW_H_
+
+#include <types.h>
+
+/*
+ * Pages shared copy-on-write after a fork. The IPT and the swapfile find
+ * a page by (owner, vaddr), so a page can't belong to two processes: at
+ * fork time all the pages of the parent are moved from its pid to a new
+ * key, that isn't the pid of any process, and both address spaces look
+ * for their pages there after their own. Reads map the shared page
+ * read-only, the first write of a process copies it.
+ * A later fork of either process shares its own pages again on top of
+ * the ones below; keys that no one else sees are reused instead.
+ */
+struct cow
+{
+	pid_t key; // owner of the shared pages in the IPT and in the swapfile
+	unsigned refs; // address spaces and cows on top of this one
+	struct cow *below; // pages shared by an earlier fork, NULL if none
+	struct cow *next; // list of the live cows, for the keys in use
+};
+
+// keys of the shared pages, frame descriptors have room for 16 bits and
+// the upper half is for the text pages (see textcache.h)
+#define COW_KEY_MIN MAX_PROCS
+#define COW_KEY_MAX 0x3fff
+
+int cow_bootstrap (void);
+struct cow *cow_share (pid_t pid, struct cow *below);
+void cow_ref (struct cow *c);
+void cow_release (struct cow *c);
+int cow_fault (struct cow *top, pid_t pid, vaddr_t vaddr, int write, int *index_pt);
+
+#endif // _COW_H_
@@ -42,6 +42,8 @@ struct addrspace;
 struct thread;
 struct vnode;
 
+#define MAX_PROCS 64 // live processes, pids are reused once freed
+
 /*
  * Process structure.
  *
@@ -83,6 +85,12 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+/* Same, returning ENPROC if all the pids are in use, ENOMEM otherwise. */
+int proc_create_user(const char *name, struct proc **ret);
+
+/* Number of processes with a pid, the kernel's included. */
+int proc_count(void);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
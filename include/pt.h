@@ -3,26 +3,53 @@
 
 #include <types.h>
 
-struct ipt_entry_t 
-{
-    pid_t pid;
-	vaddr_t vaddr;
-};
-
+// the entries are the frame descriptors of the coremap (coremap.h)
 struct ipt_t 
 {
-    struct ipt_entry_t * entry;
     int size;
+	int * hash; // hash anchor table, heads of the chains of entries
+	int hash_size; // power of 2
 };
 
+// page replacement policies
+#define PT_POLICY_FIFO 0
+#define PT_POLICY_CLOCK 1
+#define PT_POLICY_WSCLOCK 2
+
+// kinds of speculatively loaded pages
+#define PT_SPEC_NONE 0
+#define PT_SPEC_ELF 1
+#define PT_SPEC_SWAP 2
+
+// default free frame watermarks of the pageout daemon
+#define PT_LOW_WATER 8
+#define PT_HIGH_WATER 16
+
 int pt_create(void);
 int page_is_in_mem(pid_t pid, vaddr_t vaddr, int *index);
+int pt_lookup_pin (pid_t pid, vaddr_t vaddr, int *index);
+void pt_unpin (int index);
 int pt_get_FIFO_victim (void);
-int pt_get_victim (void);
+int pt_get_CLOCK_victim (int ws);
+int pt_try_get_victim (void);
+int pt_reclaim (void);
+int pt_owner_next (pid_t pid, int *index, vaddr_t *vaddr);
+int pt_rekey_page (pid_t from, pid_t to, vaddr_t vaddr);
+void pt_drop_page (pid_t pid, vaddr_t vaddr);
+void pt_discard_owner (pid_t pid);
+int pt_pageout_start (void);
+void pt_wake_pageout (void);
+int pt_set_watermarks (int low, int high);
+int pt_set_policy (const char *name);
+const char *pt_get_policy_name (void);
+void pt_set_referenced (int index);
+void pt_set_dirty (int index);
+int pt_get_dirty (int index);
+void pt_set_spec (int index, int spec);
+int pt_take_spec (int index);
 void pt_set_entry (pid_t pid, vaddr_t vaddr, int index);
 vaddr_t pt_get_vaddr (int index);
 pid_t pt_get_pid (int index);
-int getFullPages(void);
+int pt_get_size (void);
 
 #endif // _PT_H_ 
-
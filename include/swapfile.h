@@ -3,20 +3,40 @@
 
 #include <types.h>
 
-#define SWAP_SIZE 9*1024*1024 // 9 MB
-#define SWAP_TABLE_SIZE (SWAP_SIZE / PAGE_SIZE)
+#define SWAP_SIZE 9*1024*1024 // 9 MB, size of a swap file
+#define SWAP_MAX_SIZE 32*1024*1024 // 32 MB, on all the devices together
+#define SWAP_TABLE_SIZE (SWAP_MAX_SIZE / PAGE_SIZE)
+#define SWAP_CLUSTER 8 // max pages read or written with one swapfile I/O
+#define SWAP_DEFAULT "emu0:SWAPFILE" // where the slots are stored at boot
+#define SWAP_PRIO_DEFAULT 0
+#define SWAP_MAX_DEVICES 4
+#define SWAP_NAME_MAX 32
 
 typedef struct sf_entry_t 
 {
     pid_t pid;
 	vaddr_t vaddr;
+	int next; // next slot in the same hash chain, -1 if last
+	int16_t owner_next; // slots of the same owner list, -1 if last
+	int16_t owner_prev;
 }swapfile_t;
 
 int swapfile_create (void);
+int swapfile_attach (const char *name, int prio);
+int swapfile_detach (const char *name);
+int swapfile_get_priority (const char *name);
+void swapfile_print_devices (void);
 int page_is_in_swapfile(pid_t pid, vaddr_t vaddr, int *index);
 int read_from_swapfile(int index_sf, int index_pt);
+int read_cluster_from_swapfile(int index_sf, int *index_pt, int n);
+int swapfile_get_owner(int index_sf, pid_t *pid, vaddr_t *vaddr);
 int write_to_swapfile (pid_t pid, vaddr_t vaddr, int index_pt);
+int write_cluster_to_swapfile (pid_t pid, vaddr_t *vaddr, int *index_pt, int n);
+int swapfile_write_slot (int index_sf, int index_pt);
+void swapfile_free_slot (int index_sf);
+void swapfile_discard (pid_t pid, vaddr_t vaddr);
+void swapfile_rekey (pid_t from, pid_t to, vaddr_t vaddr);
+void swapfile_discard_owner (pid_t pid);
+int swapfile_owner_next (pid_t pid, int *index, vaddr_t *vaddr);
 
 #endif // _SWAPFILE_H_ 
-
-
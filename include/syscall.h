@@ -59,6 +59,8 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 int sys_read(int fd, userptr_t buf, int size);
 int sys_write(int fd, userptr_t buf, int size);
 void sys__exit(int status);
+int sys_fork(struct trapframe *ctf, pid_t *retval);
+int sys_sbrk(intptr_t amount, int32_t *retval);
  
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
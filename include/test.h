@@ -95,6 +95,14 @@ int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int nettest(int, char **);
 
+/* vm benchmarks */
+int vmbench1(int, char **);
+int vmbench2(int, char **);
+int vmbench3(int, char **);
+int vmbench4(int, char **);
+int vmbench5(int, char **);
+int vmbench6(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 
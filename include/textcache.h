@@ -0,0 +1,48 @@
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+#include <types.h>
+
+struct vnode;
+struct lock;
+
+/*
+ * Text pages of the programs being run, shared read-only by all the
+ * processes running the same ELF file. The IPT finds a page by
+ * (owner, vaddr): the pages of a read-only segment of a file are owned
+ * by a key of their own, above the pids, instead of the pid of the
+ * process that loaded them. The same segment of the same vnode always
+ * maps vaddr to the same file offset, so (key, vaddr) stands for
+ * (vnode, offset).
+ * Text pages are never written, so they are never swapped out: an
+ * evicted one is read again from the file.
+ */
+struct textcache
+{
+	struct vnode *v; // ELF file, a reference is held while cached
+	vaddr_t vbase; // text segment of the file
+	off_t offset;
+	size_t size;
+	
+	pid_t key; // owner of the text pages in the IPT
+	unsigned refs; // address spaces running it, 0 if idle
+	unsigned idle; // when the last one went away, to drop the oldest
+	struct lock *load_lock; // held while one of its pages is read
+	struct textcache *next;
+};
+
+// keys of the text pages, above those of copy-on-write (see cow.h)
+#define TEXT_KEY_MIN 0x4000
+#define TEXT_KEY_MAX 0x7fff
+
+// files kept, with their pages, after the last process running them exits
+#define TEXTCACHE_IDLE 8
+
+int textcache_bootstrap (void);
+struct textcache *textcache_get (struct vnode *v, vaddr_t vbase, off_t offset, size_t size);
+void textcache_ref (struct textcache *t);
+void textcache_release (struct textcache *t);
+int textcache_lookup (struct textcache *t, vaddr_t vaddr, int *index_pt);
+void textcache_loaded (struct textcache *t);
+
+#endif // _TEXTCACHE_H_
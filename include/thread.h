@@ -106,6 +106,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	unsigned t_vm_locks;		/* VM sleep locks held, see getppages() */
+
 	/* add more here as needed */
 };
 
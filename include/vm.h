@@ -45,6 +45,15 @@
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
 
+/* Pages prefetched after ELF and swapfile faults (default, max) */
+#define VM_FAULTAROUND       4
+#define VM_FAULTAROUND_MAX   16
+
+/* Pages the user stack can grow to (default, max), the page below is never mapped */
+#define VM_STACKPAGES        1024
+#define VM_STACKPAGES_MAX    4096
+
+
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -55,6 +64,11 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Sleep locks of the VM, the allocations made holding them don't evict */
+struct lock;
+void vm_lock_acquire(struct lock *lk);
+void vm_lock_release(struct lock *lk);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
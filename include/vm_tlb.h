@@ -1,12 +1,32 @@
 #ifndef _VM_TLB_H_
 #define _VM_TLB_H_
 
+#include <types.h>
+#include <spinlock.h>
 
-int tlb_get_rr_victim(void); 
+// acks of a batch of shootdowns, see tlb_shootdown
+struct tlbshootdown_wait {
+	struct spinlock lock;
+	unsigned pending; // cpus that haven't handled the batch yet
+};
 
-/* We only need this one function, which allows to select a TLB
-entry to be replaced, because in <mips/tlb.h> the functions needed to 
-write, read and probe the tlb, as well as constants allowing to handle 
-the tlb are already defined */ 
+void tlb_load(uint32_t ehi, uint32_t elo);
+void tlb_update(uint32_t ehi, uint32_t elo);
+void tlb_flush(void);
+void tlb_invalidate_vaddr(vaddr_t vaddr);
+int tlb_set_policy(const char *name);
+const char *tlb_get_policy_name(void);
+unsigned tlb_new_asid(void);
+int tlb_set_owner(unsigned asid, pid_t pid);
+void tlb_invalidate_local(pid_t pid, vaddr_t vaddr);
+void tlb_shootdown(const pid_t *pid, const vaddr_t *vaddr, int n);
+void tlb_shootdown_done(struct tlbshootdown_wait *wait);
+void tlb_forget(unsigned asid);
 
-#endif // _VM_TLB_H_ 
\ No newline at end of file
+/* We only need these functions, which allow to load a TLB entry choosing
+the slot to be replaced, to drop the entry of a single page and to keep track of the
+address space whose translations are in the TLB of each cpu, because in <mips/tlb.h>
+the functions needed to write, read and probe the tlb, as well as constants
+allowing to handle the tlb are already defined */ 
+
+#endif // _VM_TLB_H_ 
@@ -1,17 +1,48 @@
 #ifndef _VMSTATS_H_
 #define _VMSTATS_H_
 
+struct timespec;
+
 
 void increment_TLB_faults (void);
 void increment_TLB_faults_free (void);
 void increment_TLB_faults_replace (void);
 void increment_TLB_invalidations (void);
+void increment_TLB_activations (void);
+void increment_TLB_shootdowns (void);
 void increment_TLB_reloads (void);
 void increment_PAGE_faults_zeroed (void);
 void increment_PAGE_faults_disk (void);
 void increment_PAGE_faults_elf (void);
 void increment_PAGE_faults_swapfile (void);
 void increment_SWAPFILE_writes (void);
+void increment_SWAPFILE_discards (void);
+void increment_SWAPFILE_clusters (void);
+void increment_PAGE_dirtied (void);
+void increment_PAGEOUT_frames (void);
+void increment_COREMAP_locks (void);
+void increment_COREMAP_contention (void);
+void increment_COREMAP_reclaims (void);
+void increment_ZERO_pool_hits (void);
+void increment_ZERO_pool_misses (void);
+void increment_ZERO_frame_maps (void);
+void increment_COW_copies (void);
+int get_COW_copies (void);
+void increment_SWAP_full (void);
+void increment_OOM_kills (void);
+void record_ZSWAP_store (int len);
+void increment_ZSWAP_same (void);
+void increment_ZSWAP_rejects (void);
+void increment_ZSWAP_hits (void);
+void increment_ZSWAP_writebacks (void);
+void increment_PREFETCH_pages (void);
+void increment_PREFETCH_hits (void);
+void increment_PREFETCH_misses (void);
+void increment_SWAPIN_prefetch_pages (void);
+void increment_SWAPIN_prefetch_hits (void);
+void increment_SWAPIN_prefetch_misses (void);
+void record_PAGE_fault_latency (const struct timespec *start);
+void get_TLB_counters (int *faults, int *activations, int *invalidations);
 void print_vmstats (void);
 
 
@@ -0,0 +1,29 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <types.h>
+
+/*
+ * Compressed cache in front of the swap devices. A page evicted to swap
+ * still gets its slot, but if it compresses well its data is kept in a
+ * pool of kernel memory instead of being written: a later fault finds it
+ * there and only has to decompress it. Pages whose words are all the
+ * same (mostly zero pages) take no room at all. When the pool is full
+ * the oldest pages in it are written back to their slots to make room.
+ * Entries are indexed by slot, so the swapfile table still knows where
+ * every page is and frees the copy in the pool with the slot.
+ */
+
+#define ZSWAP_POOL_PAGES 64 // 256 KB of compressed pages
+#define ZSWAP_CHUNK 128 // unit of allocation in the pool
+#define ZSWAP_MAX_LEN (PAGE_SIZE / 2) // pages that don't fit go to the device
+
+int zswap_bootstrap (void);
+void zswap_set_enabled (int enabled);
+int zswap_is_enabled (void);
+int zswap_store (int index_sf, int index_pt);
+int zswap_load (int index_sf, int index_pt);
+int zswap_invalidate (int index_sf);
+void zswap_print_usage (void);
+
+#endif // _ZSWAP_H_
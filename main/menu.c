@@ -43,8 +43,14 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <pt.h>
+#include <vm_tlb.h>
+#include <addrspace.h>
+#include <swapfile.h>
+#include <zswap.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -453,6 +459,150 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command to select the page replacement policy. Give it on the
+ * kernel command line to have it in effect from boot.
+ */
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy fifo|clock|wsclock\n");
+		return EINVAL;
+	}
+
+	return pt_set_policy(args[1]);
+}
+
+/*
+ * Command to choose how a TLB slot is picked when all are in use.
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: tlbpolicy rr|random|plru\n");
+		return EINVAL;
+	}
+
+	return tlb_set_policy(args[1]);
+}
+
+/*
+ * Command to set the free frame watermarks of the pageout daemon.
+ * A low watermark of 0 turns it off.
+ */
+static
+int
+cmd_vmwater(int nargs, char **args)
+{
+	if (nargs != 3) {
+		kprintf("Usage: vmwater low high\n");
+		return EINVAL;
+	}
+
+	return pt_set_watermarks(atoi(args[1]), atoi(args[2]));
+}
+
+#if !OPT_DUMBVM
+/*
+ * Command to set how many pages are prefetched after sequential
+ * page faults on the program file, and read ahead after a page
+ * comes back from the swapfile. 0 turns prefetching off.
+ */
+static
+int
+cmd_vmfaultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmfaultaround npages\n");
+		return EINVAL;
+	}
+
+	return vm_set_faultaround(atoi(args[1]));
+}
+
+/*
+ * Command to add a device where pages are swapped out: a raw disk
+ * (lhd0:) or a file (emu0:SWAPFILE), with a priority (higher is used
+ * first). Without arguments, lists the devices in use.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	int prio = SWAP_PRIO_DEFAULT;
+
+	if (nargs == 1) {
+		swapfile_print_devices();
+		return 0;
+	}
+	if (nargs > 3) {
+		kprintf("Usage: swapon [device | file [priority]]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		prio = atoi(args[2]);
+	}
+
+	return swapfile_attach(args[1], prio);
+}
+
+/*
+ * Command to stop swapping to a device, once nothing is there.
+ */
+static
+int
+cmd_swapoff(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapoff device | file\n");
+		return EINVAL;
+	}
+
+	return swapfile_detach(args[1]);
+}
+
+/*
+ * Command to turn the compressed pool in front of the swap devices on
+ * or off. Without arguments, shows how full it is.
+ */
+static
+int
+cmd_zswap(int nargs, char **args)
+{
+	if (nargs == 1) {
+		zswap_print_usage();
+		return 0;
+	}
+	if (nargs != 2 || (strcmp(args[1], "on") && strcmp(args[1], "off"))) {
+		kprintf("Usage: zswap [on|off]\n");
+		return EINVAL;
+	}
+
+	zswap_set_enabled(!strcmp(args[1], "on"));
+	return 0;
+}
+
+/*
+ * Command to set how far the stack of the programs started from now on
+ * can grow, in pages.
+ */
+static
+int
+cmd_vmstack(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: vmstack npages\n");
+		return EINVAL;
+	}
+
+	return vm_set_stack_limit(atoi(args[1]));
+}
+#endif
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -536,6 +686,16 @@ static const char *opsmenu[] = {
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
+	"[vmpolicy] Page replacement policy  ",
+	"[vmwater] Pageout watermarks        ",
+	"[tlbpolicy] TLB replacement policy  ",
+#if !OPT_DUMBVM
+	"[vmfaultaround] ELF prefetch window ",
+	"[vmstack] User stack limit          ",
+	"[swapon]  Add a swap device         ",
+	"[swapoff] Remove a swap device      ",
+	"[zswap]   Compressed swap pool      ",
+#endif
 	"[q]       Quit and shut down        ",
 	NULL
 };
@@ -577,6 +737,12 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[vmb1] IPT lookup benchmark         ",
+	"[vmb2] TLB refills per switch       ",
+	"[vmb3] Parallel page faults         ",
+	"[vmb4] Frame allocator benchmark    ",
+	"[vmb5] Fork+exec benchmark          ",
+	"[vmb6] Swap device throughput       ",
 	NULL
 };
 
@@ -644,6 +810,16 @@ static struct {
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
+	{ "vmpolicy",	cmd_vmpolicy },
+	{ "vmwater",	cmd_vmwater },
+	{ "tlbpolicy",	cmd_tlbpolicy },
+#if !OPT_DUMBVM
+	{ "vmfaultaround", cmd_vmfaultaround },
+	{ "vmstack",	cmd_vmstack },
+	{ "swapon",	cmd_swapon },
+	{ "swapoff",	cmd_swapoff },
+	{ "zswap",	cmd_zswap },
+#endif
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
@@ -707,6 +883,14 @@ static struct {
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
 
+	/* vm benchmarks */
+	{ "vmb1",	vmbench1 },
+	{ "vmb2",	vmbench2 },
+	{ "vmb3",	vmbench3 },
+	{ "vmb4",	vmbench4 },
+	{ "vmb5",	vmbench5 },
+	{ "vmb6",	vmbench6 },
+
 	{ NULL, NULL }
 };
 
@@ -43,37 +43,108 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 
-// add static variable for pid 
-static int pid_tmp = 0;
+/*
+ * Live processes by pid. The VM finds the pages of a process by its pid,
+ * so a pid is only given again once its process has no threads left
+ * (it has exited) or has been destroyed. Protected by pid_lock.
+ */
+static struct proc *pidTable[MAX_PROCS];
+static int next_pid = 0; // where the search for a free pid starts
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+
+// give proc a free pid, returns ENPROC if there is none
+static int pid_alloc (struct proc *proc)
+{
+	int i, pid;
+	
+	spinlock_acquire(&pid_lock);
+	for (i = 0; i < MAX_PROCS; i++)
+	{
+		pid = (next_pid + i) % MAX_PROCS;
+		if (pidTable[pid] == NULL)
+		{
+			pidTable[pid] = proc;
+			proc->pid = pid;
+			next_pid = (pid + 1) % MAX_PROCS;
+			spinlock_release(&pid_lock);
+			return 0;
+		}
+	}
+	spinlock_release(&pid_lock);
+	
+	return ENPROC;
+}
+
+// the pid of proc can be reused, if it still has one
+static void pid_free (struct proc *proc)
+{
+	spinlock_acquire(&pid_lock);
+	if (proc->pid >= 0)
+	{
+		KASSERT(pidTable[proc->pid] == proc);
+		pidTable[proc->pid] = NULL;
+		proc->pid = -1;
+	}
+	spinlock_release(&pid_lock);
+}
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Number of processes with a pid, kproc included.
+ */
+int
+proc_count(void)
+{
+	int i, n = 0;
+
+	spinlock_acquire(&pid_lock);
+	for (i = 0; i < MAX_PROCS; i++) {
+		if (pidTable[i] != NULL) {
+			n++;
+		}
+	}
+	spinlock_release(&pid_lock);
+
+	return n;
+}
+
 /*
  * Create a proc structure.
  */
 static
-struct proc *
-proc_create(const char *name)
+int
+proc_create(const char *name, struct proc **ret)
 {
 	struct proc *proc;
+	int result;
 
 	proc = kmalloc(sizeof(*proc));
 	if (proc == NULL) {
-		return NULL;
+		return ENOMEM;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
 		kfree(proc);
-		return NULL;
+		return ENOMEM;
+	}
+
+	// Pid
+	result = pid_alloc(proc);
+	if (result) {
+		kfree(proc->p_name);
+		kfree(proc);
+		return result;
 	}
 
 	proc->p_numthreads = 0;
@@ -84,12 +155,9 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
-	
-	// Pid
-	proc->pid = (pid_t) pid_tmp;
-	pid_tmp = (pid_tmp + 1) % 64; //Maximum of 64 unique processes
 
-	return proc;
+	*ret = proc;
+	return 0;
 }
 
 /*
@@ -175,6 +243,8 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc->p_numthreads == 0);
 	spinlock_cleanup(&proc->p_lock);
 
+	pid_free(proc);
+
 	kfree(proc->p_name);
 	kfree(proc);
 }
@@ -185,8 +255,7 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
-	kproc = proc_create("[kernel]");
-	if (kproc == NULL) {
+	if (proc_create("[kernel]", &kproc)) {
 		panic("proc_create for kproc failed\n");
 	}
 }
@@ -202,11 +271,28 @@ proc_create_runprogram(const char *name)
 {
 	struct proc *newproc;
 
-	newproc = proc_create(name);
-	if (newproc == NULL) {
+	if (proc_create_user(name, &newproc)) {
 		return NULL;
 	}
 
+	return newproc;
+}
+
+/*
+ * As proc_create_runprogram(), with the reason of a failure: ENPROC
+ * if all the pids are in use.
+ */
+int
+proc_create_user(const char *name, struct proc **ret)
+{
+	struct proc *newproc;
+	int result;
+
+	result = proc_create(name, &newproc);
+	if (result) {
+		return result;
+	}
+
 	/* VM fields */
 
 	newproc->p_addrspace = NULL;
@@ -225,7 +311,8 @@ proc_create_runprogram(const char *name)
 	}
 	spinlock_release(&curproc->p_lock);
 
-	return newproc;
+	*ret = newproc;
+	return 0;
 }
 
 /*
@@ -268,6 +355,7 @@ void
 proc_remthread(struct thread *t)
 {
 	struct proc *proc;
+	unsigned numthreads;
 	int spl;
 
 	proc = t->t_proc;
@@ -275,12 +363,18 @@ proc_remthread(struct thread *t)
 
 	spinlock_acquire(&proc->p_lock);
 	KASSERT(proc->p_numthreads > 0);
-	proc->p_numthreads--;
+	numthreads = --proc->p_numthreads;
 	spinlock_release(&proc->p_lock);
 
 	spl = splhigh();
 	t->t_proc = NULL;
 	splx(spl);
+
+	// Nothing waits for a process that exits: its pid is free once it
+	// has no threads, and it freed its pages with its address space.
+	if (numthreads == 0 && proc != kproc) {
+		pid_free(proc);
+	}
 }
 
 /*
@@ -8,6 +8,8 @@
 #include <kern/unistd.h>
 #include <proc.h>
 #include <lib.h>
+#include <kern/errno.h>
+#include <mips/trapframe.h>
 
 int sys_read(int fd, userptr_t buf, int size)
 {
@@ -57,3 +59,64 @@ void sys__exit(int status)
 	thread_exit();
 	(void) status;
 }
+
+static void call_enter_forked_process(void *tfv, unsigned long dummy)
+{
+	(void)dummy;
+	enter_forked_process((struct trapframe *)tfv);
+}
+
+// the child gets a copy-on-write copy of the address space (see as_copy)
+// and returns 0 from the same trapframe
+int sys_fork(struct trapframe *ctf, pid_t *retval)
+{
+	struct trapframe *tf_child;
+	struct proc *newp;
+	int result;
+	
+	result = proc_create_user(curproc->p_name, &newp);
+	if (result)
+		return result;
+	
+	result = as_copy(curproc->p_addrspace, &newp->p_addrspace, newp->pid);
+	if (result)
+	{
+		proc_destroy(newp);
+		return result;
+	}
+	
+	tf_child = kmalloc(sizeof(struct trapframe));
+	if (tf_child == NULL)
+	{
+		proc_destroy(newp);
+		return ENOMEM;
+	}
+	memcpy(tf_child, ctf, sizeof(struct trapframe));
+	
+	result = thread_fork(curthread->t_name, newp, call_enter_forked_process, tf_child, 0);
+	if (result)
+	{
+		proc_destroy(newp);
+		kfree(tf_child);
+		return result;
+	}
+	
+	*retval = newp->pid;
+	
+	return 0;
+}
+
+// move the end of the heap by amount bytes, returns the old end
+int sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	vaddr_t old_end;
+	int result;
+	
+	result = as_sbrk(proc_getas(), amount, &old_end);
+	if (result)
+		return result;
+	
+	*retval = (int32_t) old_end;
+	
+	return 0;
+}
@@ -0,0 +1,824 @@
+/*
+ * Benchmarks for the virtual memory system.
+ *
+ * These are meant to be run with different sys161.conf settings (RAM
+ * size, number of CPUs) and compared, so each one prints the machine
+ * parameters it depends on together with its timings.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+#include <pt.h>
+#include <vmstats.h>
+#include <coremap.h>
+#include <swapfile.h>
+#include <zswap.h>
+
+#include "opt-dumbvm.h"
+
+// number of iterations of each timed loop
+#define VMB_NLOOPS 20000
+
+// number of resident pages sampled for the lookup hits
+#define VMB_NSAMPLES 64
+
+// default length in seconds of the sampling benchmarks
+#define VMB_SECONDS 5
+
+// default threads and pages of each thread of the parallel fault benchmark
+#define VMB_NTHREADS 4
+#define VMB_NPAGES 256
+
+// default pages of the parent and number of forks of the fork benchmark
+#define VMB_FORK_PAGES 64
+#define VMB_NFORKS 16
+
+// default raw disk, pages and max devices of the swap benchmark, and the
+// priority it gives them
+#define VMB_SWAP_DEVICE "lhd0:"
+#define VMB_SWAP_PAGES 512
+#define VMB_SWAP_MAXDEV 4
+#define VMB_SWAP_PRIO 1000
+
+// elapsed time in nanoseconds
+static
+uint64_t
+vmbench_ns(const struct timespec *before, const struct timespec *after)
+{
+	struct timespec duration;
+
+	timespec_sub(after, before, &duration);
+	return (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////
+// vmb1
+
+/*
+ * Cost of an inverted page table lookup, which is what every TLB
+ * miss pays before it can reload the TLB.
+ *
+ * Misses use the kernel pid, that never owns user pages, so they walk
+ * a whole hash chain; hits use pages that are resident at the time
+ * (run a user program first to have some). With the hashed IPT both
+ * should stay flat when the RAM size grows.
+ */
+int
+vmbench1(int nargs, char **args)
+{
+	struct timespec before, after;
+	pid_t pids[VMB_NSAMPLES];
+	vaddr_t vaddrs[VMB_NSAMPLES];
+	int nsamples, index, found;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	nsamples = 0;
+	for (i=0; i<pt_get_size() && nsamples<VMB_NSAMPLES; i++) {
+		if (pt_get_pid(i) > 0) {
+			pids[nsamples] = pt_get_pid(i);
+			vaddrs[nsamples] = pt_get_vaddr(i);
+			nsamples++;
+		}
+	}
+
+	kprintf("vmb1: %d frames, %d resident user pages sampled\n",
+		pt_get_size(), nsamples);
+
+	found = 0;
+	gettime(&before);
+	for (i=0; i<VMB_NLOOPS; i++) {
+		found += page_is_in_mem(0, (vaddr_t)(i % 0x7fff) * PAGE_SIZE,
+					&index);
+	}
+	gettime(&after);
+	KASSERT(found == 0);
+
+	kprintf("vmb1: miss: %llu ns per lookup\n",
+		(unsigned long long)vmbench_ns(&before, &after) / VMB_NLOOPS);
+
+	if (nsamples == 0) {
+		kprintf("vmb1: no user pages in memory, skipping hits\n");
+		return 0;
+	}
+
+	gettime(&before);
+	for (i=0; i<VMB_NLOOPS; i++) {
+		found += page_is_in_mem(pids[i % nsamples],
+					vaddrs[i % nsamples], &index);
+	}
+	gettime(&after);
+	KASSERT(found == VMB_NLOOPS);
+
+	kprintf("vmb1: hit: %llu ns per lookup\n",
+		(unsigned long long)vmbench_ns(&before, &after) / VMB_NLOOPS);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vmb2
+
+/*
+ * TLB refills per context switch.
+ *
+ * Start two or more user programs that share the cpu (e.g. "p
+ * testbin/matmult" twice) and then run "vmb2 [seconds]": it samples
+ * the TLB counters over that interval. Activations that found their
+ * own translations still in the TLB didn't flush it, so the refills
+ * after them are only the ones the process would have anyway.
+ */
+int
+vmbench2(int nargs, char **args)
+{
+	int faults0, activations0, flushes0;
+	int faults, activations, flushes;
+	int seconds;
+
+	seconds = VMB_SECONDS;
+	if (nargs > 1) {
+		seconds = atoi(args[1]);
+	}
+	if (seconds <= 0) {
+		kprintf("Usage: vmb2 [seconds]\n");
+		return EINVAL;
+	}
+
+	get_TLB_counters(&faults0, &activations0, &flushes0);
+	clocksleep(seconds);
+	get_TLB_counters(&faults, &activations, &flushes);
+
+	faults -= faults0;
+	activations -= activations0;
+	flushes -= flushes0;
+
+	kprintf("vmb2: %d s, %d switches, %d TLB flushes, %d TLB refills\n",
+		seconds, activations, flushes, faults);
+
+	if (activations == 0) {
+		kprintf("vmb2: no user process was switched in\n");
+		return 0;
+	}
+
+	kprintf("vmb2: %d.%02d TLB refills per switch, %d%% switches flushed\n",
+		faults / activations, (faults % activations) * 100 / activations,
+		flushes * 100 / activations);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vmb3
+
+#if !OPT_DUMBVM
+
+// an empty program: just enough for vm_fault to find the stack
+static
+struct addrspace *
+vmbench_as_create(void)
+{
+	struct addrspace *as;
+	vaddr_t stackptr;
+	int result;
+
+	as = as_create();
+	if (as == NULL) {
+		panic("vmbench: as_create failed\n");
+	}
+
+	result = as_define_region(as, 0x400000, PAGE_SIZE, 0, 0, NULL, 1, 0, 1);
+	if (result == 0) {
+		result = as_define_region(as, 0x400000 + PAGE_SIZE, PAGE_SIZE,
+					  0, 0, NULL, 1, 1, 0);
+	}
+	if (result == 0) {
+		result = as_define_stack(as, &stackptr);
+	}
+	if (result) {
+		panic("vmbench: can't define the regions: %s\n",
+		      strerror(result));
+	}
+
+	return as;
+}
+
+/*
+ * One of the vmb3 threads: it gets a process and an address space of its
+ * own and faults in npages stack pages, each one a zero-fill fault that
+ * needs a frame (and a replacement once RAM is full). The faults are
+ * writes: a read would only map the shared zero frame.
+ */
+static
+void
+vmbench3_thread(void *data1, unsigned long npages)
+{
+	struct semaphore *done = data1;
+	struct addrspace *as;
+	unsigned long i;
+	int result;
+
+	as = vmbench_as_create();
+
+	proc_setas(as);
+	as_activate();
+
+	for (i=0; i<npages; i++) {
+		result = vm_fault(VM_FAULT_WRITE, USERSTACK - (i+1) * PAGE_SIZE);
+		if (result) {
+			panic("vmb3: vm_fault failed: %s\n", strerror(result));
+		}
+	}
+
+	proc_setas(NULL);
+	as_deactivate();
+	as_destroy(as);
+
+	V(done);
+}
+
+#endif
+
+/*
+ * Page fault throughput with several threads faulting at once, to be
+ * run with different numbers of cpus in sys161.conf: with the striped
+ * IPT locks it should grow with them, as long as the RAM isn't so small
+ * that every fault has to wait for a victim.
+ */
+int
+vmbench3(int nargs, char **args)
+{
+#if OPT_DUMBVM
+	(void)nargs;
+	(void)args;
+	kprintf("vmb3: needs the VM system, not dumbvm\n");
+	return 0;
+#else
+	struct timespec before, after;
+	struct semaphore *done;
+	struct proc *proc;
+	unsigned long npages;
+	uint64_t ns, nfaults;
+	int nthreads, i, result;
+
+	nthreads = VMB_NTHREADS;
+	npages = VMB_NPAGES;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		npages = atoi(args[2]);
+	}
+	if (nargs > 3 || nthreads <= 0 || (long)npages <= 0) {
+		kprintf("Usage: vmb3 [threads] [pages]\n");
+		return EINVAL;
+	}
+
+	done = sem_create("vmb3", 0);
+	if (done == NULL) {
+		return ENOMEM;
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		proc = proc_create_runprogram("vmb3");
+		if (proc == NULL) {
+			panic("vmb3: proc_create_runprogram failed\n");
+		}
+		result = thread_fork("vmb3", proc, vmbench3_thread,
+				     done, npages);
+		if (result) {
+			panic("vmb3: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(done);
+	}
+	gettime(&after);
+
+	sem_destroy(done);
+
+	ns = vmbench_ns(&before, &after);
+	nfaults = (uint64_t)nthreads * npages;
+	kprintf("vmb3: %d threads, %llu faults in %llu ms\n", nthreads,
+		(unsigned long long)nfaults, (unsigned long long)ns / 1000000);
+	kprintf("vmb3: %llu ns per fault, %llu faults/s\n",
+		(unsigned long long)(ns / nfaults),
+		(unsigned long long)(nfaults * 1000000000 / ns));
+
+	return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// vmb4
+
+// time VMB_NLOOPS allocations of npages frames, each freed right away
+static
+void
+vmbench4_frames(unsigned long npages)
+{
+	struct timespec before, after;
+	paddr_t paddr;
+	int i, failed;
+
+	failed = 0;
+	gettime(&before);
+	for (i=0; i<VMB_NLOOPS; i++) {
+		paddr = getfreeppages(npages);
+		if (paddr == 0) {
+			failed++;
+			continue;
+		}
+		freeppages(paddr);
+	}
+	gettime(&after);
+
+	kprintf("vmb4: %lu frames: %llu ns per alloc+free (%d failed)\n",
+		npages,
+		(unsigned long long)vmbench_ns(&before, &after) / VMB_NLOOPS,
+		failed);
+}
+
+/*
+ * Latency of the frame allocator, to be compared across RAM sizes:
+ * single frames (user faults), small runs and multi-page kmallocs, that
+ * go through alloc_kpages.
+ */
+int
+vmbench4(int nargs, char **args)
+{
+	struct timespec before, after;
+	void *ptr;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("vmb4: %d frames, %d free\n", pt_get_size(),
+		coremap_get_nfree());
+
+	vmbench4_frames(1);
+	vmbench4_frames(4);
+	vmbench4_frames(7);
+
+	gettime(&before);
+	for (i=0; i<VMB_NLOOPS; i++) {
+		ptr = kmalloc(3 * PAGE_SIZE);
+		if (ptr == NULL) {
+			kprintf("vmb4: kmalloc failed\n");
+			return ENOMEM;
+		}
+		kfree(ptr);
+	}
+	gettime(&after);
+
+	kprintf("vmb4: kmalloc(3 pages): %llu ns per kmalloc+kfree\n",
+		(unsigned long long)vmbench_ns(&before, &after) / VMB_NLOOPS);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// vmb5
+
+#if !OPT_DUMBVM
+
+struct vmbench5_args {
+	struct semaphore *done;
+	int nforks;
+};
+
+// write npages stack pages of the current address space
+static
+void
+vmbench5_touch(unsigned long npages)
+{
+	unsigned long i;
+	int result;
+
+	for (i=0; i<npages; i++) {
+		result = vm_fault(VM_FAULT_WRITE, USERSTACK - (i+1) * PAGE_SIZE);
+		if (result) {
+			panic("vmb5: vm_fault failed: %s\n", strerror(result));
+		}
+	}
+}
+
+// nforks fork+exec of the current process, eager or copy-on-write; the
+// parent writes its pages again after each one
+static
+uint64_t
+vmbench5_forks(int nforks, unsigned long npages, int eager)
+{
+	struct timespec before, after;
+	struct addrspace *as = proc_getas();
+	struct proc *child;
+	int i, result;
+
+	gettime(&before);
+	for (i=0; i<nforks; i++) {
+		child = proc_create_runprogram("vmb5 child");
+		if (child == NULL) {
+			panic("vmb5: proc_create_runprogram failed\n");
+		}
+
+		if (eager) {
+			result = as_copy_eager(as, &child->p_addrspace,
+					       child->pid);
+		}
+		else {
+			result = as_copy(as, &child->p_addrspace,
+					 child->pid);
+		}
+		if (result) {
+			panic("vmb5: as_copy failed: %s\n", strerror(result));
+		}
+
+		// exec: the child throws its copy away right away
+		proc_destroy(child);
+
+		vmbench5_touch(npages);
+	}
+	gettime(&after);
+
+	return vmbench_ns(&before, &after);
+}
+
+static
+void
+vmbench5_thread(void *data1, unsigned long npages)
+{
+	struct vmbench5_args *args = data1;
+	struct addrspace *as;
+	uint64_t eager, cow;
+	int copies0, copies;
+
+	as = vmbench_as_create();
+
+	proc_setas(as);
+	as_activate();
+
+	vmbench5_touch(npages);
+
+	eager = vmbench5_forks(args->nforks, npages, 1);
+
+	copies0 = get_COW_copies();
+	cow = vmbench5_forks(args->nforks, npages, 0);
+	copies = get_COW_copies() - copies0;
+
+	kprintf("vmb5: eager copy: %llu us per fork+exec\n",
+		(unsigned long long)eager / args->nforks / 1000);
+	kprintf("vmb5: copy-on-write: %llu us per fork+exec, %d pages copied\n",
+		(unsigned long long)cow / args->nforks / 1000, copies);
+
+	proc_setas(NULL);
+	as_deactivate();
+	as_destroy(as);
+
+	V(args->done);
+}
+
+#endif
+
+/*
+ * Cost of fork followed right away by exec, as a shell does, with the
+ * eager copy of the address space and with copy-on-write. The parent
+ * has npages dirty pages and writes them again after each fork; with
+ * copy-on-write, once the child is gone, they are given back to it
+ * without copies.
+ */
+int
+vmbench5(int nargs, char **args)
+{
+#if OPT_DUMBVM
+	(void)nargs;
+	(void)args;
+	kprintf("vmb5: needs the VM system, not dumbvm\n");
+	return 0;
+#else
+	struct vmbench5_args a;
+	struct proc *proc;
+	unsigned long npages;
+	int result;
+
+	npages = VMB_FORK_PAGES;
+	a.nforks = VMB_NFORKS;
+	if (nargs > 1) {
+		npages = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		a.nforks = atoi(args[2]);
+	}
+	if (nargs > 3 || (long)npages <= 0 || a.nforks <= 0) {
+		kprintf("Usage: vmb5 [pages] [forks]\n");
+		return EINVAL;
+	}
+
+	a.done = sem_create("vmb5", 0);
+	if (a.done == NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("vmb5: %lu pages, %d forks, %d frames\n", npages, a.nforks,
+		pt_get_size());
+
+	proc = proc_create_runprogram("vmb5");
+	if (proc == NULL) {
+		panic("vmb5: proc_create_runprogram failed\n");
+	}
+	result = thread_fork("vmb5", proc, vmbench5_thread, &a, npages);
+	if (result) {
+		panic("vmb5: thread_fork failed: %s\n", strerror(result));
+	}
+	P(a.done);
+
+	sem_destroy(a.done);
+
+	return 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////
+// vmb6
+
+#if !OPT_DUMBVM
+
+struct vmbench6_args {
+	pid_t pid;
+	vaddr_t vbase;
+	unsigned long npages;
+	int frames[SWAP_CLUSTER];
+	struct semaphore *go;
+	struct semaphore *done;
+};
+
+// write the pages of a thread to swap and read them back, a cluster at a
+// time, each direction when the main thread says go
+static
+void
+vmbench6_thread(void *data1, unsigned long data2)
+{
+	struct vmbench6_args *a = data1;
+	vaddr_t vaddrs[SWAP_CLUSTER];
+	pid_t owner;
+	vaddr_t vaddr;
+	unsigned long done;
+	int i, n, index_sf, result;
+
+	(void)data2;
+
+	P(a->go);
+	for (done = 0; done < a->npages; done += n) {
+		n = (a->npages - done < SWAP_CLUSTER) ? a->npages - done : SWAP_CLUSTER;
+		for (i=0; i<n; i++) {
+			vaddrs[i] = a->vbase + (done + i) * PAGE_SIZE;
+		}
+		result = write_cluster_to_swapfile(a->pid, vaddrs, a->frames, n);
+		if (result) {
+			panic("vmb6: write failed: %s\n", strerror(result));
+		}
+	}
+	V(a->done);
+
+	P(a->go);
+	for (done = 0; done < a->npages; done += n) {
+		n = (a->npages - done < SWAP_CLUSTER) ? a->npages - done : SWAP_CLUSTER;
+		vaddr = a->vbase + done * PAGE_SIZE;
+		if (!page_is_in_swapfile(a->pid, vaddr, &index_sf)) {
+			panic("vmb6: page 0x%x not in swap\n", vaddr);
+		}
+
+		// the cluster may have been split if the swap was fragmented
+		if (!swapfile_get_owner(index_sf + n - 1, &owner, &vaddr) ||
+		    owner != a->pid ||
+		    vaddr != a->vbase + (done + n - 1) * PAGE_SIZE) {
+			n = 1;
+		}
+		result = read_cluster_from_swapfile(index_sf, a->frames, n);
+		if (result) {
+			panic("vmb6: read failed: %s\n", strerror(result));
+		}
+	}
+	V(a->done);
+}
+
+static
+void
+vmbench6_report(const char *what, unsigned long npages, uint64_t ns)
+{
+	kprintf("vmb6:   %s: %llu KB/s\n", what,
+		(unsigned long long)npages * (PAGE_SIZE / 1024) * 1000000000ULL /
+		(ns > 0 ? ns : 1));
+}
+
+// npages pages, split among the threads, to the devices with the
+// highest priority and back
+static
+void
+vmbench6_run(struct vmbench6_args *args, unsigned long npages)
+{
+	struct timespec before, after;
+	uint64_t ns[2];
+	int i, phase, result;
+
+	for (i=0; i<VMB_NTHREADS; i++) {
+		args[i].npages = npages / VMB_NTHREADS;
+		args[i].vbase = i * args[i].npages * PAGE_SIZE;
+		result = thread_fork("vmb6", NULL, vmbench6_thread, &args[i], 0);
+		if (result) {
+			panic("vmb6: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (phase=0; phase<2; phase++) {
+		gettime(&before);
+		for (i=0; i<VMB_NTHREADS; i++) {
+			V(args[i].go);
+		}
+		for (i=0; i<VMB_NTHREADS; i++) {
+			P(args[i].done);
+		}
+		gettime(&after);
+		ns[phase] = vmbench_ns(&before, &after);
+	}
+
+	swapfile_discard_owner(args[0].pid);
+
+	npages = args[0].npages * VMB_NTHREADS;
+	vmbench6_report("write", npages, ns[0]);
+	vmbench6_report("read", npages, ns[1]);
+}
+
+// give the devices the highest priority, saving the old ones; returns
+// the number that could be attached
+static
+int
+vmbench6_attach(char **devices, int *prio, int n)
+{
+	int i, result, ok = 0;
+
+	for (i=0; i<n; i++) {
+		prio[i] = swapfile_get_priority(devices[i]);
+		result = swapfile_attach(devices[i], VMB_SWAP_PRIO);
+		if (result) {
+			kprintf("vmb6: can't swap to %s: %s\n", devices[i],
+				strerror(result));
+			prio[i] = VMB_SWAP_PRIO;
+			continue;
+		}
+		ok++;
+	}
+	return ok;
+}
+
+static
+void
+vmbench6_restore(char **devices, int *prio, int n)
+{
+	int i, result;
+
+	for (i=0; i<n; i++) {
+		if (prio[i] == VMB_SWAP_PRIO) {
+			continue;
+		}
+		if (prio[i] < 0) {
+			result = swapfile_detach(devices[i]);
+		}
+		else {
+			result = swapfile_attach(devices[i], prio[i]);
+		}
+		if (result) {
+			kprintf("vmb6: can't restore %s: %s\n", devices[i],
+				strerror(result));
+		}
+	}
+}
+
+#endif
+
+/*
+ * Swap throughput of each device alone and of all of them together,
+ * with the same priority, so that clusters are spread over them: pages
+ * are written out and read back a cluster at a time by several threads,
+ * as the pageout daemon and the faults do. The devices get back their
+ * priorities at the end (or are detached, if they weren't in use), and
+ * zswap its setting. Both are system-wide, so it only runs when no
+ * other process is running.
+ */
+int
+vmbench6(int nargs, char **args)
+{
+#if OPT_DUMBVM
+	(void)nargs;
+	(void)args;
+	kprintf("vmb6: needs the VM system, not dumbvm\n");
+	return 0;
+#else
+	static char default_file[] = SWAP_DEFAULT;
+	static char default_device[] = VMB_SWAP_DEVICE;
+	struct vmbench6_args a[VMB_NTHREADS];
+	char *defaults[2];
+	char **devices;
+	int prio[VMB_SWAP_MAXDEV];
+	unsigned long npages;
+	struct proc *proc;
+	vaddr_t kaddr;
+	int i, j, ndevices, zswap;
+
+	npages = VMB_SWAP_PAGES;
+	if (nargs > 1) {
+		npages = atoi(args[1]);
+	}
+	if ((long)npages < VMB_NTHREADS || nargs > 2 + VMB_SWAP_MAXDEV) {
+		kprintf("Usage: vmb6 [pages] [device ...]\n");
+		return EINVAL;
+	}
+
+	if (nargs > 2) {
+		devices = &args[2];
+		ndevices = nargs - 2;
+	}
+	else {
+		defaults[0] = default_file;
+		defaults[1] = default_device;
+		devices = defaults;
+		ndevices = 2;
+	}
+
+	// the priorities and zswap are those of the whole system
+	if (proc_count() > 1) {
+		kprintf("vmb6: other processes are running, try again when "
+			"they are done\n");
+		return EBUSY;
+	}
+
+	// the pages written belong to a pid of their own
+	proc = proc_create_runprogram("vmb6");
+	if (proc == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<VMB_NTHREADS; i++) {
+		a[i].pid = proc->pid;
+		a[i].go = sem_create("vmb6 go", 0);
+		a[i].done = sem_create("vmb6 done", 0);
+		if (a[i].go == NULL || a[i].done == NULL) {
+			panic("vmb6: sem_create failed\n");
+		}
+		for (j=0; j<SWAP_CLUSTER; j++) {
+			kaddr = alloc_kpages(1);
+			if (kaddr == 0) {
+				panic("vmb6: out of memory\n");
+			}
+			a[i].frames[j] = (kaddr - MIPS_KSEG0) / PAGE_SIZE;
+		}
+	}
+
+	kprintf("vmb6: %lu pages, %d threads\n", npages, VMB_NTHREADS);
+
+	// measure the devices, not the compressed pool
+	zswap = zswap_is_enabled();
+	zswap_set_enabled(0);
+
+	for (i=0; i<ndevices; i++) {
+		if (vmbench6_attach(&devices[i], &prio[i], 1) == 1) {
+			kprintf("vmb6: %s\n", devices[i]);
+			vmbench6_run(a, npages);
+		}
+		vmbench6_restore(&devices[i], &prio[i], 1);
+	}
+
+	if (ndevices > 1) {
+		if (vmbench6_attach(devices, prio, ndevices) > 1) {
+			kprintf("vmb6: all of them, striped\n");
+			vmbench6_run(a, npages);
+		}
+		vmbench6_restore(devices, prio, ndevices);
+	}
+
+	for (i=0; i<VMB_NTHREADS; i++) {
+		for (j=0; j<SWAP_CLUSTER; j++) {
+			free_kpages(PADDR_TO_KVADDR((paddr_t)a[i].frames[j] * PAGE_SIZE));
+		}
+		sem_destroy(a[i].go);
+		sem_destroy(a[i].done);
+	}
+	proc_destroy(proc);
+	zswap_set_enabled(zswap);
+
+	return 0;
+#endif
+}
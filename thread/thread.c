@@ -147,6 +147,9 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* VM fields */
+	thread->t_vm_locks = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -1137,22 +1140,19 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	while (n == TLBSHOOTDOWN_MAX) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * The target has an IPI pending already and empties
+		 * its queue when it takes it; wait for that, letting
+		 * our own interrupts in, in case it is waiting for us.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		spinlock_release(&target->c_ipi_lock);
+		KASSERT(curcpu->c_spinlocks == 0);
+		spinlock_acquire(&target->c_ipi_lock);
+		n = target->c_numshootdown;
 	}
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
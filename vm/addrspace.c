@@ -40,6 +40,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include <addrspace.h>
 #include <coremap.h>
@@ -47,6 +48,9 @@
 #include <pt.h>
 #include <swapfile.h>
 #include <vm_tlb.h>
+#include <cow.h>
+#include <textcache.h>
+#include <zswap.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -54,6 +58,11 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+// A kernel frame that is always zero. Read faults on stack and bss pages
+// that were never written map it read-only, without an IPT entry: the
+// first write faults again and gets a frame of its own.
+static paddr_t zeroFrame = 0;
+
 
  void vm_bootstrap(void)
 {	
@@ -64,14 +73,36 @@
 		panic ("Can't create Swapfile");
 		
 	coremap_bootstrap();
+	
+	zeroFrame = getppages(1);
+	if (zeroFrame == 0)
+		panic ("Can't allocate the zero frame");
+	as_zero_region(zeroFrame, 1);
+	
+	// before anything can be evicted
+	if (zswap_bootstrap())
+		panic ("Can't create the compressed swap pool");
+	
+	if (pt_pageout_start())
+		panic ("Can't start the pageout daemon");
+	
+	if (coremap_zero_start())
+		panic ("Can't start the zeroing thread");
+	
+	if (cow_bootstrap())
+		panic ("Can't set up copy-on-write");
+	
+	if (textcache_bootstrap())
+		panic ("Can't set up the text cache");
 
 }
 
-// should be callled from interprocessor interrupt
+// called from the interprocessor interrupt, see tlb_shootdown()
 void vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	tlb_invalidate_local(ts->ts_pid, ts->ts_vaddr);
+	if (ts->ts_wait != NULL)
+		tlb_shootdown_done(ts->ts_wait);
 }
 
 void as_zero_region(paddr_t paddr, unsigned npages)
@@ -118,28 +149,260 @@ int load_page_on_demand(struct vnode* v, paddr_t paddr, size_t memsize, size_t f
 	return result;
 }
 
+// number of pages prefetched after sequential ELF faults and read ahead
+// after swapfile faults, 0 turns it off
+static int faultaround = VM_FAULTAROUND;
+
+int vm_set_faultaround(int npages)
+{
+	if (npages < 0 || npages > VM_FAULTAROUND_MAX)
+		return EINVAL;
+	
+	faultaround = npages;
+	return 0;
+}
+
+// pages the stack of the programs loaded from now on can grow to
+static int stack_pages = VM_STACKPAGES;
+
+int vm_set_stack_limit(int npages)
+{
+	if (npages <= 0 || npages > VM_STACKPAGES_MAX)
+		return EINVAL;
+	
+	stack_pages = npages;
+	return 0;
+}
+
+// Called after faultaddress has been loaded from the segment r. If the previous ELF fault was on the page just before,
+// the access is sequential: the next pages of the segment are read with a
+// single VOP_READ into free frames and entered in the IPT, so that touching
+// them only costs a TLB reload. Only pages that are entirely in the file
+// are prefetched, and only while free frames are available.
+static void vm_fault_around(struct addrspace *as, pid_t pid, vaddr_t faultaddress,
+	struct region *r)
+{
+	vaddr_t vbase = r->vbase;
+	size_t filesize = r->filesize;
+	int frames[VM_FAULTAROUND_MAX];
+	struct iovec iov[VM_FAULTAROUND_MAX];
+	struct uio u;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	int i, n, index;
+	
+	if (faultaddress != as->last_fault + PAGE_SIZE)
+	{
+		as->last_fault = faultaddress;
+		return;
+	}
+	as->last_fault = faultaddress;
+	
+	for (n = 0; n < faultaround; n++)
+	{
+		vaddr = faultaddress + (n + 1) * PAGE_SIZE;
+		
+		if (vaddr < vbase || vaddr + PAGE_SIZE > vbase + filesize)
+			break;
+		if (page_is_in_mem(pid, vaddr, &index) || page_is_in_swapfile(pid, vaddr, &index))
+			break;
+		
+		// never replace pages to make room for a guess
+		paddr = getuserppage();
+		if (paddr == 0)
+			break;
+		
+		frames[n] = paddr / PAGE_SIZE;
+		iov[n].iov_kbase = (void *)PADDR_TO_KVADDR(paddr);
+		iov[n].iov_len = PAGE_SIZE;
+	}
+	
+	if (n == 0)
+		return;
+	
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = r->offset + (faultaddress + PAGE_SIZE - vbase);
+	u.uio_resid = n * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = NULL;
+	
+	if (VOP_READ(r->v, &u) || u.uio_resid != 0)
+	{
+		// it was only a guess, give the frames back
+		for (i = 0; i < n; i++)
+			freeppages((paddr_t) frames[i] * PAGE_SIZE);
+		return;
+	}
+	
+	for (i = 0; i < n; i++)
+	{
+		vaddr = faultaddress + (i + 1) * PAGE_SIZE;
+		pt_set_entry(pid, vaddr, frames[i]);
+		pt_set_spec(frames[i], PT_SPEC_ELF);
+		pt_unpin(frames[i]);
+		increment_PREFETCH_pages();
+	}
+	
+	// the next fault is expected right after the prefetched pages
+	as->last_fault = faultaddress + n * PAGE_SIZE;
+}
+
+// Called after faultaddress has been read from swap slot index_sf.
+// Pages of a process that were swapped out together are in neighbouring
+// slots (see write_cluster_to_swapfile), so the slots that follow and hold
+// nearby pages of the same process are read too, with one I/O, into free
+// frames. They are entered in the IPT as speculative until first used.
+static void vm_swap_around(pid_t pid, vaddr_t faultaddress, int index_sf)
+{
+	int frames[SWAP_CLUSTER];
+	vaddr_t vaddrs[SWAP_CLUSTER];
+	vaddr_t vaddr, distance;
+	paddr_t paddr;
+	pid_t owner;
+	int i, n, index;
+	
+	for (n = 0; n < faultaround && n < SWAP_CLUSTER; n++)
+	{
+		if (!swapfile_get_owner(index_sf + n + 1, &owner, &vaddr) || owner != pid)
+			break;
+		
+		distance = vaddr > faultaddress ? vaddr - faultaddress : faultaddress - vaddr;
+		if (distance > (vaddr_t) faultaround * PAGE_SIZE)
+			break;
+		if (page_is_in_mem(pid, vaddr, &index))
+			break;
+		
+		// never replace pages to make room for a guess
+		paddr = getuserppage();
+		if (paddr == 0)
+			break;
+		
+		frames[n] = paddr / PAGE_SIZE;
+		vaddrs[n] = vaddr;
+	}
+	
+	if (n == 0)
+		return;
+	
+	if (read_cluster_from_swapfile(index_sf + 1, frames, n))
+	{
+		// it was only a guess, give the frames back
+		for (i = 0; i < n; i++)
+			freeppages((paddr_t) frames[i] * PAGE_SIZE);
+		return;
+	}
+	
+	for (i = 0; i < n; i++)
+	{
+		pt_set_entry(pid, vaddrs[i], frames[i]);
+		pt_set_spec(frames[i], PT_SPEC_SWAP);
+		pt_unpin(frames[i]);
+		increment_SWAPIN_prefetch_pages();
+	}
+}
+
+// first write to a page: its copy in the swapfile (if any) is now stale
+static void vm_set_dirty(pid_t pid, vaddr_t vaddr, int index_pt)
+{
+	increment_PAGE_dirtied();
+	pt_set_dirty(index_pt);
+	swapfile_discard(pid, vaddr);
+}
+
+// Memory and swap are full and the process needs a frame: it is killed,
+// its pages are freed with the address space. The caller holds no lock.
+static void vm_kill_oom(struct addrspace *as, pid_t pid)
+{
+	kprintf("Out of memory and swap space: killing %s (pid %d)\n", curproc->p_name, pid);
+	increment_OOM_kills();
+	
+	as_destroy(as); // free space used for address space
+	thread_exit(); // exit current thread without crashing
+}
+
+// A page that isn't one of the process's own, in memory or in the
+// swapfile, may be shared copy-on-write with its parent or children.
+// Returns 1 with the frame to map (pinned) if it is. If it needs a frame
+// and there is none the process is killed.
+static int vm_cow_lookup(struct addrspace *as, pid_t pid, vaddr_t vaddr, int write, int *index_pt)
+{
+	struct region *heap;
+	int index_sf, result;
+	
+	if (as->cow == NULL || page_is_in_swapfile(pid, vaddr, &index_sf))
+		return 0;
+	
+	// a heap page given back and grown again is a new, zero-filled one:
+	// the shared page at the same address is its content before the fork
+	if (as->heap >= 0)
+	{
+		heap = &as->regions[as->heap];
+		if (vaddr >= heap->vbase && vaddr >= as->heap_cow_top && vaddr < heap->vtop)
+			return 0;
+	}
+	
+	result = cow_fault(as->cow, pid, vaddr, write, index_pt);
+	if (result < 0)
+		vm_kill_oom(as, pid);
+	
+	return result;
+}
+
+// Region that holds vaddr, NULL if none: binary search of the sorted
+// table, the segments don't overlap.
+static struct region *as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *r;
+	int lo = 0, hi = as->nregions - 1, mid;
+	
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		r = &as->regions[mid];
+		
+		if (vaddr < (r->vbase & PAGE_FRAME))
+			hi = mid - 1;
+		else if (vaddr >= r->vtop)
+			lo = mid + 1;
+		else
+			return r;
+	}
+	
+	return NULL;
+}
+
+// Part of the page at vaddr that is read from the file of r, between
+// *start and *end. Returns 0 if the page is all zero-filled.
+static int region_file_part(struct region *r, vaddr_t vaddr, vaddr_t *start, vaddr_t *end)
+{
+	if (r->v == NULL)
+		return 0;
+	
+	*start = vaddr > r->vbase ? vaddr : r->vbase;
+	*end = vaddr + PAGE_SIZE < r->vbase + r->filesize ? vaddr + PAGE_SIZE : r->vbase + r->filesize;
+	
+	return *start < *end;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t text_vbase, text_vtop, data_vbase, data_vtop, stacktop; // virtual addresses
+	struct region *r; // segment of the fault
+	vaddr_t start, end; // part of the page read from the file
 	paddr_t paddr; // physical address
-	int i;
-	uint32_t ehi, elo, old_elo, old_ehi; // tlb entry - high and low
+	uint32_t ehi, elo; // tlb entry - high and low
 	struct addrspace *as;
 	int spl; // used to disable interrupts when accessing the tlb
+	struct timespec fault_start; // for the page fault latency
 
+	gettime(&fault_start);
 	faultaddress &= PAGE_FRAME;
 	//DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		// In our case text is read-only, so we might get this
-		increment_TLB_faults();
-		kprintf ("Attempted to read a read-only segment\n");
-		as = proc_getas();
-		as_destroy(as); // free space used for address space
-		thread_exit(); // exit current thread without crashing
-		break;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -168,206 +431,195 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 	
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->text_vbase != 0);
-	KASSERT(as->text_npages != 0);
-	KASSERT(as->data_vbase != 0);
-	KASSERT(as->data_npages != 0);	
-
-	text_vbase = as->text_vbase;
-	text_vtop = (text_vbase & PAGE_FRAME) + as->text_npages * PAGE_SIZE; // compute top of text
-	data_vbase = as->data_vbase;
-	data_vtop = (data_vbase & PAGE_FRAME) + as->data_npages * PAGE_SIZE; // compute top of data
-	
-	stacktop = USERSTACK;
-	
 	int index_sf;
 	int index_pt;
+	int in_swapfile, zeroed, zero_fill, writable;
 	pid_t pid = curproc->pid;
+	pid_t owner = pid; // whose page it is in the IPT and in the swapfile
 	
+	KASSERT(as->pid == pid);
 	
-	int IS_TEXT = 0;
-	int IS_DATA = 0;
-	int IS_STACK = 0;
-	
-	if (faultaddress >= (text_vbase & PAGE_FRAME) && faultaddress < text_vtop)
-		IS_TEXT = 1;
-	else if (faultaddress >= (data_vbase & PAGE_FRAME) && faultaddress < data_vtop)
-		IS_DATA = 1;
-	else if (faultaddress >= data_vtop && faultaddress < stacktop)
-		IS_STACK = 1;
-	else
+	r = as_find_region(as, faultaddress);
+	if (r == NULL)
 		return EFAULT;
+	writable = (r->flags & REGION_WRITE) != 0;
+	
+	// pages of read-only segments are shared by all the processes running the file
+	if (r->text != NULL)
+		owner = r->text->key;
+	
+	if (faulttype == VM_FAULT_READONLY)
+	{
+		// text is read-only, so we might get this
+		if (!writable)
+		{
+			increment_TLB_faults();
+			kprintf ("Attempted to read a read-only segment\n");
+			as_destroy(as); // free space used for address space
+			thread_exit(); // exit current thread without crashing
+		}
+		
+		// data and stack pages are mapped read-only until the first write,
+		// which makes them dirty: upgrade the TLB entry in place
+		if (pt_lookup_pin(pid, faultaddress, &index_pt))
+		{
+			vm_set_dirty(pid, faultaddress, index_pt);
+			
+			spl = splhigh();
+			tlb_update(faultaddress, (index_pt * PAGE_SIZE) | TLBLO_DIRTY | TLBLO_VALID);
+			splx(spl);
+			pt_unpin(index_pt);
+			return 0;
+		}
+		
+		// The page has been replaced meanwhile, or it's the zero frame or
+		// shared copy-on-write: it's a write miss. The read-only translation
+		// goes first, from this TLB and the ones the process left behind, so
+		// that the new one isn't loaded next to it and no one keeps reading
+		// the old frame.
+		tlb_shootdown(&pid, &faultaddress, 1);
+		faulttype = VM_FAULT_WRITE;
+	}
 	
 	increment_TLB_faults();
 	
-	// page hit
-	if(page_is_in_mem(pid, faultaddress, &index_pt))
+	// page hit, the page is pinned until it's in the TLB
+	if(pt_lookup_pin(owner, faultaddress, &index_pt))
+	{
+		increment_TLB_reloads();
+		paddr = index_pt * PAGE_SIZE;
+		
+		switch (pt_take_spec(index_pt)) {
+		    case PT_SPEC_ELF:
+			increment_PREFETCH_hits();
+			break;
+		    case PT_SPEC_SWAP:
+			increment_SWAPIN_prefetch_hits();
+			break;
+		}
+	}
+	else if (owner == pid && vm_cow_lookup(as, pid, faultaddress, faulttype == VM_FAULT_WRITE && writable, &index_pt))
+	{
+		paddr = index_pt * PAGE_SIZE;
+	}
+	// loaded by another process while we waited for the text lock
+	else if (owner != pid && textcache_lookup(r->text, faultaddress, &index_pt))
 	{
 		increment_TLB_reloads();
 		paddr = index_pt * PAGE_SIZE;
 	}
 	else{
+		in_swapfile = page_is_in_swapfile(owner, faultaddress, &index_sf);
+		zero_fill = !region_file_part(r, faultaddress, &start, &end);
+		
+		// reading a page that was never written: share the zero frame
+		if (!in_swapfile && zero_fill && owner == pid && faulttype == VM_FAULT_READ)
+		{
+			increment_PAGE_faults_zeroed();
+			increment_ZERO_frame_maps();
+			
+			spl = splhigh();
+			tlb_load(faultaddress, zeroFrame | TLBLO_VALID);
+			splx(spl);
+			
+			record_PAGE_fault_latency(&fault_start);
+			return 0;
+		}
+		
+		// stack and bss pages that were never swapped out are zero-filled:
+		// take a frame already zeroed if there is one
+		zeroed = 0;
+		paddr = 0;
+		if (!in_swapfile && zero_fill)
+		{
+			paddr = getzeroedppage();
+			zeroed = (paddr != 0);
+		}
+		
 		// find paddr (page replacement if needed)
-		index_pt = pt_get_victim(); 
-		paddr = (paddr_t) index_pt * PAGE_SIZE; // the ipt covers all pages
+		if (paddr == 0)
+		{
+			index_pt = pt_try_get_victim();
+			if (index_pt < 0)
+			{
+				if (owner != pid)
+					textcache_loaded(r->text);
+				vm_kill_oom(as, pid);
+			}
+			paddr = (paddr_t) index_pt * PAGE_SIZE; // the ipt covers all pages
+		}
+		index_pt = paddr / PAGE_SIZE;
 		
-		// set new entry to pt
-		pt_set_entry(pid, faultaddress, index_pt);
+		// set new entry to pt, pinned while it's loaded
+		pt_set_entry(owner, faultaddress, index_pt);
 		
-		if (page_is_in_swapfile(pid, faultaddress, &index_sf))
+		if (in_swapfile)
 		{
 			increment_PAGE_faults_disk();
 			increment_PAGE_faults_swapfile();
 			// write from swapfile to memory 
 			if (read_from_swapfile(index_sf, index_pt)) 
 				panic("Can't read from swapfile\n");
+			
+			vm_swap_around(pid, faultaddress, index_sf);
 		}
-	
-		// needs to be loaded from disk exploiting info in ELF file
-		else
+		
+		// uninitialized data, stack
+		else if (zero_fill)
 		{
-			// Text segment
-			if (IS_TEXT) 
-			{		
-				size_t amount_to_read;
-					
-
-				off_t offset_elf  = as->text_offset + faultaddress - (text_vbase & PAGE_FRAME);
-				paddr_t paddr_tmp = paddr;
-				vaddr_t text_vbase_off = text_vbase & ~PAGE_FRAME;
-				
-				// First page of text segment to read from elf
-				if (faultaddress == (text_vbase & PAGE_FRAME))
-				{
-					paddr_tmp += text_vbase_off;
-					if (as->text_size >= PAGE_SIZE - text_vbase_off)
-						amount_to_read = PAGE_SIZE - text_vbase_off;
-					else
-						amount_to_read = as->text_size;
-					
-				}
-				// Last page of text segment to read from elf
-				else if (faultaddress == ((text_vbase + as->text_size) & PAGE_FRAME))
-				{
-					amount_to_read = (as->text_size - (PAGE_SIZE - text_vbase_off)) &~ PAGE_FRAME;
-					offset_elf -= text_vbase_off;
-				}
-				// Middle page of text segment to read from elf
-				else 
-				{
-					amount_to_read = PAGE_SIZE;
-					offset_elf -= text_vbase_off;
-				}
-				
-				if (load_page_on_demand(as->v, paddr_tmp, PAGE_SIZE, amount_to_read, offset_elf))
-					panic ("can't load page on demand\n");
-												
-				increment_PAGE_faults_disk();
-				increment_PAGE_faults_elf();
-				
-				
-				
+			increment_PAGE_faults_zeroed();
+			if (zeroed)
+				increment_ZERO_pool_hits();
+			else
+			{
+				increment_ZERO_pool_misses();
+				as_zero_region(paddr, 1);
 			}
+		}
+		
+		// needs to be loaded from disk exploiting info in ELF file; the
+		// bytes of the page outside the file part are zeroed
+		else
+		{
+			if (load_page_on_demand(r->v, paddr + (start - faultaddress), PAGE_SIZE,
+				end - start, r->offset + (start - r->vbase)))
+				panic ("can't load page on demand\n");
 			
-			// Data segment
-			else if (IS_DATA) 
-			{		
-				size_t amount_to_read;
-				paddr_t paddr_tmp = paddr;
-				
-				// Uninitialized global data
-				if (faultaddress > ((data_vbase + as->data_size) & PAGE_FRAME))
-				{
-					as_zero_region(paddr, 1);
-					increment_PAGE_faults_zeroed();
-				}
-				// It's at least partially initialized data
-				else
-				{
-					off_t offset_elf = as->data_offset + faultaddress - (data_vbase & PAGE_FRAME);
-					vaddr_t data_vbase_off = data_vbase & ~PAGE_FRAME;
-					
-					// First page of data segment to read from elf 
-					if (faultaddress == (as->data_vbase & PAGE_FRAME))
-					{
-						paddr_tmp += data_vbase_off;
-						if (as->data_size >= PAGE_SIZE - data_vbase_off)
-							amount_to_read = PAGE_SIZE - data_vbase_off;
-						else
-							amount_to_read = as->data_size;
-						
-					}
-					// Last page of data segment to read from elf 
-					else if (faultaddress == ((data_vbase + as->data_size) & PAGE_FRAME))
-					{
-						amount_to_read = (as->data_size - (PAGE_SIZE - data_vbase_off)) &~ PAGE_FRAME;
-						offset_elf -= data_vbase_off;
-					}
-					// Middle page of data segment to read from elf
-					else 
-					{
-						amount_to_read = PAGE_SIZE;
-						offset_elf -= data_vbase_off;
-					}
-					
-					if (load_page_on_demand(as->v, paddr_tmp, PAGE_SIZE, amount_to_read, offset_elf))
-						panic ("can't load page on demand\n");
-						
-					increment_PAGE_faults_disk();
-					increment_PAGE_faults_elf();
-				}	
-			}
+			increment_PAGE_faults_disk();
+			increment_PAGE_faults_elf();
 			
-			// Stack segment
-			else if (IS_STACK)
-			{
-				increment_PAGE_faults_zeroed();
-				// zero the region we want to use for the stack
-				as_zero_region(paddr, 1);		
-			}
+			vm_fault_around(as, owner, faultaddress, r);
 		}
+		
+		if (owner != pid)
+			textcache_loaded(r->text);
+		
+		record_PAGE_fault_latency(&fault_start);
 	}
 	
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
+	
+	// the page is being used, give it a second chance in the clock
+	pt_set_referenced(index_pt);
+	if (faulttype == VM_FAULT_WRITE && writable && !pt_get_dirty(index_pt))
+		vm_set_dirty(pid, faultaddress, index_pt);
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
 	// Load an appropriate entry into the TLB (replacing an existing TLB entry if necessary)
-	// substitute the following code
-	int INVALID_FOUND = 0;
-	
 	ehi = faultaddress;
-	if (IS_TEXT)
-		elo = paddr | TLBLO_VALID; //read-only
-	else
+	// shared pages (owned by a cow key) are never writable
+	if (pt_get_dirty(index_pt) && pt_get_pid(index_pt) == pid)
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	else
+		elo = paddr | TLBLO_VALID; //read-only until written
 	
+	tlb_load(ehi, elo);
+	splx(spl);
 	
-	// Search for invalid TLB entry
-	for (i=0; i<NUM_TLB; i++) 
-	{
-		tlb_read(&old_ehi, &old_elo, i);
-		if (!(old_elo & TLBLO_VALID)) 
-		{
-			increment_TLB_faults_free();
-			tlb_write(ehi, elo, i);
-			splx(spl);
-			INVALID_FOUND = 1;
-			return 0;
-		}
-	}
-	
-	// Need to replace a TBL entry
-	if (!INVALID_FOUND)
-	{
-		increment_TLB_faults_replace();
-		int index_TLB = tlb_get_rr_victim();
-		tlb_write(ehi, elo, index_TLB);
-		splx(spl);
-	}
+	pt_unpin(index_pt);
 	
 	return 0;
 }
@@ -417,35 +669,158 @@ as_create(void)
 		return NULL;
 	}
 
-	as->text_vbase = 0;
-	as->text_offset = 0;
-	as->text_npages = 0;
-	as->text_size = 0;
+	as->nregions = 0;
+	as->heap = -1;
+	as->heap_end = 0;
+	as->heap_cow_top = 0;
+	as->last_fault = 0;
 	
-	as->data_vbase = 0;
-	as->data_offset = 0;
-	as->data_npages = 0;
-	as->data_size = 0;
+	as->asid = tlb_new_asid();
+	as->cow = NULL;
+	
+	// the process creating it, as_copy() and as_copy_eager() set the child
+	as->pid = (curproc != NULL) ? curproc->pid : -1;
 	
 	return as;
 }
 
+// the regions of old, same ELF file
+static void as_copy_regions(struct addrspace *old, struct addrspace *newas)
+{
+	int i;
+	
+	for (i = 0; i < old->nregions; i++)
+	{
+		newas->regions[i] = old->regions[i];
+		if (old->regions[i].text != NULL)
+			textcache_ref(old->regions[i].text);
+	}
+	newas->nregions = old->nregions;
+	newas->heap = old->heap;
+	newas->heap_end = old->heap_end;
+	newas->heap_cow_top = old->heap_cow_top;
+}
+
+// Copy-on-write for the process pid: nothing is copied, all the pages of
+// old (that of the current process) become shared between the two address
+// spaces, see cow.h. They are copied by the first write of either process.
 int
-as_copy(struct addrspace *old, struct addrspace **ret)
+as_copy(struct addrspace *old, struct addrspace **ret, pid_t pid)
 {
 	struct addrspace *newas;
 
+	// the pages of old are found by the pid of the process running
+	KASSERT(old == proc_getas());
+	
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
+	
+	as_copy_regions(old, newas);
+	newas->pid = pid;
+	
+	newas->cow = cow_share(curproc->pid, old->cow);
+	if (newas->cow == NULL) {
+		as_destroy(newas);
+		return ENOMEM;
+	}
+	old->cow = newas->cow;
+	
+	// the whole heap is shared now
+	if (old->heap >= 0)
+	{
+		old->heap_cow_top = old->regions[old->heap].vtop;
+		newas->heap_cow_top = old->heap_cow_top;
+	}
+	
+	// The TLBs may hold writable translations of the pages that are now
+	// shared: with a new asid every cpu flushes them before running us.
+	tlb_forget(old->asid);
+	old->asid = tlb_new_asid();
+	as_activate();
 
-	/*
-	 * Write this.
-	 */
-
-	(void)old;
+	*ret = newas;
+	return 0;
+}
 
+// Eager copy for the process pid: every page of old (that of the current
+// process) in memory or in the swapfile is copied to a new frame. This is
+// what fork did before copy-on-write, vmb5 compares the two.
+int
+as_copy_eager(struct addrspace *old, struct addrspace **ret, pid_t pid)
+{
+	struct addrspace *newas;
+	pid_t from = curproc->pid;
+	vaddr_t vaddr;
+	int i, src, dst, index_sf, result;
+	
+	KASSERT(old == proc_getas());
+	
+	newas = as_create();
+	if (newas==NULL) {
+		return ENOMEM;
+	}
+	
+	as_copy_regions(old, newas);
+	
+	// the pages that old shares are still shared
+	if (old->cow != NULL)
+		cow_ref(old->cow);
+	newas->cow = old->cow;
+	newas->pid = pid;
+	
+	// The pages of old, on the lists of the process. The copies can evict
+	// the page just copied and restart the walk: pages already copied are
+	// skipped.
+	for (i = -1; pt_owner_next(from, &i, &vaddr); )
+	{
+		if (page_is_in_mem(pid, vaddr, &dst) || page_is_in_swapfile(pid, vaddr, &index_sf))
+			continue;
+		// evicted meanwhile: it is copied from the swapfile
+		if (!pt_lookup_pin(from, vaddr, &src))
+			continue;
+		
+		dst = pt_try_get_victim();
+		if (dst < 0)
+		{
+			pt_unpin(src);
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		pt_set_entry(pid, vaddr, dst);
+		memcpy((void *)PADDR_TO_KVADDR((paddr_t) dst * PAGE_SIZE),
+			(void *)PADDR_TO_KVADDR((paddr_t) src * PAGE_SIZE), PAGE_SIZE);
+		pt_set_dirty(dst);
+		pt_unpin(dst);
+		pt_unpin(src);
+	}
+	
+	for (i = -1; swapfile_owner_next(from, &i, &vaddr); )
+	{
+		// already copied from memory
+		if (page_is_in_mem(pid, vaddr, &dst) || page_is_in_swapfile(pid, vaddr, &index_sf))
+			continue;
+		
+		dst = pt_try_get_victim();
+		if (dst < 0)
+		{
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		pt_set_entry(pid, vaddr, dst);
+		result = read_from_swapfile(i, dst);
+		if (result == 0)
+			pt_set_dirty(dst);
+		pt_unpin(dst);
+		if (result)
+		{
+			// the copies made so far go with newas
+			as_destroy(newas);
+			return result;
+		}
+	}
+	
 	*ret = newas;
 	return 0;
 }
@@ -453,14 +828,33 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	int i;
+	
 	vm_can_sleep();
+	tlb_forget(as->asid);
+	
+	// its frames and slots, so that the next process finds them free
+	// (and a process that gets the pid again doesn't find its pages)
+	if (as->pid != -1)
+	{
+		pt_discard_owner(as->pid);
+		swapfile_discard_owner(as->pid);
+	}
+	
+	if (as->cow != NULL)
+		cow_release(as->cow);
+	for (i = 0; i < as->nregions; i++)
+	{
+		if (as->regions[i].text != NULL)
+			textcache_release(as->regions[i].text);
+	}
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
+	int spl;
 	struct addrspace *as;
 	
 	as = proc_getas();
@@ -472,13 +866,19 @@ as_activate(void)
 		return;
 	}
 
+	increment_TLB_activations();
+	
 	// Disable interrupts on this CPU while frobbing the TLB. 
 	spl = splhigh();
 	
-	// Loading invalid entries in the TLB
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	// The TLB still holds our translations if we were the last to run here
+	if (!tlb_set_owner(as->asid, curproc->pid)) {
+		splx(spl);
+		return;
 	}
+	
+	// Loading invalid entries in the TLB
+	tlb_flush();
 
 	splx(spl);
 	
@@ -497,60 +897,70 @@ as_deactivate(void)
 	 */
 }
 
+// Add the segment [vaddr, vtop) to the sorted table, fails if it
+// overlaps another one or the table is full.
+static int as_add_region(struct addrspace *as, vaddr_t vaddr, vaddr_t vtop,
+	size_t file_sz, off_t offset, struct vnode *v, int flags)
+{
+	struct region *r;
+	int i;
+	
+	if (as->nregions == AS_MAX_REGIONS) {
+		kprintf("vm: Warning: too many regions\n");
+		return ENOSYS;
+	}
+	
+	// first segment above the new one
+	for (i = 0; i < as->nregions && as->regions[i].vtop <= (vaddr & PAGE_FRAME); i++);
+	
+	if (i < as->nregions && (as->regions[i].vbase & PAGE_FRAME) < vtop)
+		return EINVAL;
+	
+	memmove(&as->regions[i + 1], &as->regions[i], (as->nregions - i) * sizeof(struct region));
+	as->nregions++;
+	
+	r = &as->regions[i];
+	r->vbase = vaddr;
+	r->vtop = vtop;
+	r->offset = offset;
+	r->filesize = file_sz;
+	r->v = v;
+	r->flags = flags;
+	r->text = NULL;
+	
+	return 0;
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
- * VADDR+MEMSIZE.
+ * VADDR+MEMSIZE. Its first FILE_SZ bytes are read from V at OFFSET
+ * when they are first touched, the rest is zero-filled.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes to
+ * a segment that isn't writeable kill the process.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz, size_t file_sz, off_t offset, 
 	struct vnode *v, int readable, int writeable, int executable)
 {
-	size_t npages;
+	vaddr_t vtop;
+	int flags = 0;
 	
 	vm_can_sleep();
 
-	/* Align the region. First, the base... */
-	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
-	//vaddr &= PAGE_FRAME; // removed to provide aligmnement between vaddr e paddr
-
-	/* ...and now the length. */
-	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	// vaddr isn't aligned, to provide alignment between vaddr and paddr
+	vtop = (vaddr + sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	npages = sz / PAGE_SIZE;
-
-	/* We don't use these - all pages are read-write */
-	// Actually might want to use this since text should be read-only
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	
-	as->v = v;
+	if (readable)
+		flags |= REGION_READ;
+	if (writeable)
+		flags |= REGION_WRITE;
+	if (executable)
+		flags |= REGION_EXEC;
 	
-	if (as->text_vbase == 0) {
-		as->text_vbase = vaddr;
-		as->text_npages = npages;
-		as->text_offset = offset;
-		as->text_size = file_sz;
-		return 0;
-	}
-
-	if (as->data_vbase == 0) {
-		as->data_vbase = vaddr;
-		as->data_npages = npages;
-		as->data_offset = offset;
-		as->data_size = file_sz;
-		return 0;
-	}
-	
-	// can't handle more than two regions
-	kprintf("vm: Warning: too many regions\n");
-	return ENOSYS;
+	return as_add_region(as, vaddr, vtop, file_sz, offset, v, flags);
 }
 
 int
@@ -564,25 +974,54 @@ as_prepare_load(struct addrspace *as)
 	return 0;
 }
 
+// the pages of read-only segments are looked up in those of the other
+// processes running the same file
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	struct region *r;
+	int i;
+	
+	for (i = 0; i < as->nregions; i++)
+	{
+		r = &as->regions[i];
+		if (r->v == NULL || (r->flags & REGION_WRITE) || r->text != NULL)
+			continue;
+		
+		r->text = textcache_get(r->v, r->vbase, r->offset, r->filesize);
+		if (r->text == NULL)
+			return ENOMEM;
+	}
+	
 	return 0;
 }
 
+// Below USERSTACK the stack can grow up to stack_pages pages, above the
+// last segment an empty heap is grown by sbrk. A page between them is
+// never mapped, so that neither runs into the other unnoticed.
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	vaddr_t top, vbase;
+	int result;
+	
+	top = (as->nregions > 0) ? as->regions[as->nregions - 1].vtop : 0;
+	
+	vbase = USERSTACK - (vaddr_t) stack_pages * PAGE_SIZE;
+	if (vbase < top + PAGE_SIZE)
+		vbase = top + PAGE_SIZE;
+	if (vbase >= USERSTACK)
+		return ENOMEM;
+	
+	result = as_add_region(as, top, top, 0, 0, NULL, REGION_READ | REGION_WRITE | REGION_HEAP);
+	if (result)
+		return result;
+	as->heap = as->nregions - 1;
+	as->heap_end = top;
+	
+	result = as_add_region(as, vbase, USERSTACK, 0, 0, NULL, REGION_READ | REGION_WRITE);
+	if (result)
+		return result;
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -590,3 +1029,48 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+// Move the end of the heap by amount bytes and return the old one in
+// *old_end. New pages are zero-filled on demand, the pages given back are
+// freed right away.
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *old_end)
+{
+	struct region *heap;
+	vaddr_t end, vtop, limit, vaddr;
+	pid_t pid = curproc->pid;
+	
+	KASSERT(as == proc_getas());
+	
+	if (as->heap < 0)
+		return ENOSYS;
+	heap = &as->regions[as->heap];
+	
+	end = as->heap_end + amount;
+	if ((amount < 0 && end > as->heap_end) || (amount > 0 && end < as->heap_end))
+		return amount < 0 ? EINVAL : ENOMEM;
+	if (end < heap->vbase)
+		return EINVAL;
+	
+	// one unmapped page must stay below the next segment (the stack)
+	limit = (as->heap + 1 < as->nregions) ? (as->regions[as->heap + 1].vbase & PAGE_FRAME) : USERSTACK;
+	vtop = (end + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (vtop + PAGE_SIZE > limit)
+		return ENOMEM;
+	
+	// Pages given back: out of the TLBs first, then out of memory and swap.
+	// Pages still shared copy-on-write stay with the other processes.
+	for (vaddr = vtop; vaddr < heap->vtop; vaddr += PAGE_SIZE)
+	{
+		tlb_shootdown(&pid, &vaddr, 1);
+		pt_drop_page(pid, vaddr);
+		swapfile_discard(pid, vaddr);
+	}
+	if (vtop < as->heap_cow_top)
+		as->heap_cow_top = vtop;
+	
+	*old_end = as->heap_end;
+	as->heap_end = end;
+	heap->vtop = vtop;
+	
+	return 0;
+}
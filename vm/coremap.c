@@ -6,11 +6,15 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
+#include <synch.h>
 #include <mips/tlb.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 #include <coremap.h>
 #include <pt.h>
+#include <vmstats.h>
 
 // Wrap ram_stealmem and free_mem in a spinlock.
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER; 
@@ -18,20 +22,180 @@ static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
 
 
 // global variables 
-static unsigned char *freeRamFrames = NULL;
-static unsigned long *allocSize = NULL;
+struct frame *frameTable = NULL;
 static int nRamFrames = 0;
+static int nFreeFrames = 0;
 static int allocTableActive = 0;
 
+/*
+ * Buddy allocator. A free block of 2^k frames starts at a frame aligned
+ * to 2^k and is on the free list of order k; its buddy is the block
+ * whose start differs only in bit k, and the two are merged when both
+ * are free. The lists are doubly linked through the frame descriptors,
+ * so allocating and freeing take O(log n) steps.
+ * The first frame of an allocation keeps the number of frames actually
+ * allocated: the tail of a block that isn't needed is given back right
+ * away.
+ */
+static int *freeHead = NULL; // first block of each order, -1 if none
+static int maxOrder = 0;
 
-int isTableActive () {
-	int active;
-	
+/*
+ * Per-cpu magazines of free single frames. A magazine is used by its cpu
+ * with interrupts off and under its own lock, that other cpus only take
+ * to empty it when the lists run out; so single frames (all user faults
+ * and most kernel pages) are allocated and freed without freemem_lock.
+ * It's taken to move COREMAP_BATCH frames at a time between a magazine
+ * and the lists.
+ */
+#define COREMAP_MAGAZINE 16
+#define COREMAP_BATCH 8
+
+struct magazine {
+	struct spinlock lock;
+	int n;
+	int frames[COREMAP_MAGAZINE];
+};
+
+static struct magazine magazines[MAXCPUS];
+
+/*
+ * The last free frames are kept for the kernel: user pages can always be
+ * evicted to make room, but a kernel allocation can't wait for that when
+ * it holds a spinlock, nor when it comes from the eviction itself
+ * (e.g. a swapfile write).
+ */
+#define COREMAP_RESERVE 4
+
+/*
+ * Pool of pre-zeroed frames for zero-fill faults (stack and bss). It's
+ * refilled by a thread that zeroes free frames when it is woken up and
+ * memory isn't short, yielding the cpu after each page. Frames in the
+ * pool are kernel frames; they go back to the allocations when memory
+ * runs out.
+ */
+#define COREMAP_ZERO_POOL 16
+
+static struct spinlock zero_lock = SPINLOCK_INITIALIZER;
+static int zeroPool[COREMAP_ZERO_POOL];
+static int nZeroed = 0;
+static struct semaphore *zero_sem = NULL;
+static int zero_wanted = 0;
+
+// take freemem_lock, counting the times another cpu is holding it
+static void coremap_lock (void)
+{
+	increment_COREMAP_locks();
+	if (spinlock_data_get(&freemem_lock.splk_lock) != 0)
+		increment_COREMAP_contention();
 	spinlock_acquire(&freemem_lock);
-	active = allocTableActive;
-	spinlock_release(&freemem_lock);
+}
+
+// The following helpers are called with freemem_lock held
+
+static void buddy_push (int i, int k)
+{
+	struct frame *f = &frameTable[i];
+	
+	f->state = FRAME_FREE;
+	f->pid = -1;
+	f->order = k;
+	f->prev = -1;
+	f->next = freeHead[k];
+	if (freeHead[k] != -1)
+		frameTable[freeHead[k]].prev = i;
+	freeHead[k] = i;
+}
+
+static void buddy_remove (int i, int k)
+{
+	struct frame *f = &frameTable[i];
+	
+	if (f->prev != -1)
+		frameTable[f->prev].next = f->next;
+	else
+		freeHead[k] = f->next;
+	if (f->next != -1)
+		frameTable[f->next].prev = f->prev;
+	f->order = -1;
+}
+
+// is i the start of a free block of order k (in the lists, not in a magazine)
+static int buddy_is_free (int i, int k)
+{
+	return FRAME_IS(&frameTable[i], FRAME_FREE) && frameTable[i].order == k;
+}
+
+// free the block of 2^k frames at i, merging it with its free buddies
+static void buddy_free_block (int i, int k)
+{
+	int b;
+	
+	while (k < maxOrder)
+	{
+		b = i ^ (1 << k);
+		if (b >= nRamFrames || !buddy_is_free(b, k))
+			break;
+		buddy_remove(b, k);
+		if (b < i)
+			i = b;
+		k++;
+	}
+	
+	buddy_push(i, k);
+}
+
+// free n frames from first, as the largest aligned blocks that fit
+static void buddy_free_range (int first, int n)
+{
+	int i, k;
+	
+	for (i = first; i < first + n; i++)
+	{
+		frameTable[i].order = -1;
+		frameTable[i].state = FRAME_FREE;
+	}
+	
+	while (n > 0)
+	{
+		for (k = 0; k < maxOrder && (first & (1 << k)) == 0 && (2 << k) <= n; k++);
+		buddy_free_block(first, k);
+		first += 1 << k;
+		n -= 1 << k;
+	}
+}
+
+// take np contiguous frames, -1 if there isn't a large enough block
+static int buddy_alloc (int np)
+{
+	int i, j, k;
+	
+	for (k = 0; (1 << k) < np; k++);
 	
-	return active;
+	for (j = k; j <= maxOrder && freeHead[j] == -1; j++);
+	if (j > maxOrder)
+		return -1;
+	
+	i = freeHead[j];
+	buddy_remove(i, j);
+	
+	// split, keeping the first half
+	while (j > k)
+	{
+		j--;
+		buddy_push(i + (1 << j), j);
+	}
+	
+	if ((1 << k) > np)
+		buddy_free_range(i + np, (1 << k) - np);
+	
+	return i;
+}
+
+
+// set once at bootstrap and never cleared, no need to lock
+int isTableActive () {
+	return allocTableActive;
 }
 
 void coremap_bootstrap(void) {
@@ -40,16 +204,18 @@ void coremap_bootstrap(void) {
 	paddr_t firstpaddr;
 	
 	nRamFrames = ((int)ram_getsize())/PAGE_SIZE;
+	KASSERT(nRamFrames <= 0x7fff); // frame indices are 16 bits
+	
+	for (maxOrder = 0; (1 << maxOrder) < nRamFrames; maxOrder++);
 	
-	/* alloc freeRamFrame and allocSize */
-	freeRamFrames = kmalloc(sizeof(unsigned char)*nRamFrames);
-	allocSize = kmalloc(sizeof(unsigned long)*nRamFrames);
+	/* alloc the frame table and the heads of the buddy lists */
+	frameTable = kmalloc(sizeof(struct frame)*nRamFrames);
+	freeHead = kmalloc(sizeof(int)*(maxOrder+1));
 	
-	if (freeRamFrames==NULL || allocSize==NULL)
+	if (frameTable==NULL || freeHead==NULL)
 	{
 		/* reset to disable this vm management */
-		freeRamFrames = NULL; 
-		allocSize = NULL;
+		frameTable = NULL;
 		return;
 	}
 	
@@ -57,21 +223,33 @@ void coremap_bootstrap(void) {
 	
 	fullpages = ((int)firstpaddr)/ PAGE_SIZE;
 	
+	for (i=0; i<=maxOrder; i++)
+	{
+		freeHead[i] = -1;
+	}
+	
+	for (i=0; i<MAXCPUS; i++)
+	{
+		spinlock_init(&magazines[i].lock);
+		magazines[i].n = 0;
+	}
+	
+	// the frames used so far are the kernel's, one by one
 	for (i=0; i<nRamFrames; i++) 
 	{
-		if (i<fullpages)
-		{
-			freeRamFrames[i] = (unsigned char)0; 
-			allocSize[i] = 1;
-		}
-		else
-		{
-			freeRamFrames[i] = (unsigned char)1; 
-			allocSize[i] = 0;
-		}
+		frameTable[i].vaddr = 0;
+		frameTable[i].next = -1;
+		frameTable[i].prev = 1;
+		frameTable[i].owner_next = -1;
+		frameTable[i].owner_prev = -1;
+		frameTable[i].pid = -1;
+		frameTable[i].state = FRAME_KERNEL;
+		frameTable[i].order = -1;
 	}
 	
 	spinlock_acquire(&freemem_lock);
+	buddy_free_range(fullpages, nRamFrames - fullpages);
+	nFreeFrames = nRamFrames - fullpages;
 	allocTableActive = 1;
 	spinlock_release(&freemem_lock);
 }
@@ -84,102 +262,337 @@ paddr_t getppages(unsigned long npages)
 	/* try freed pages first */
 	addr = getfreeppages(npages);
 	
-	// no free pages, take whatever corresponds to the first available virtual address
-	// need to change this to get pages according to page replacement ???
-	if (addr == 0) {
-		if (!isTableActive())
-		{
-			spinlock_acquire(&stealmem_lock);
-			addr = ram_stealmem(npages);
-			spinlock_release(&stealmem_lock);
-		}
-		else
-		{
-			// in case of a kmalloc being called when memory is fullpages
-			// we free the first space of the "over-writable" memory and use
-			// it to store the structure/variable addresses by kmalloc
-			// we update the page table to flag that page as "not over-writable"
-			int index_pt = getFullPages();
-			addr = index_pt * PAGE_SIZE;
-			// set NULL entry to pt to flag it as "not over-writable"
-			pt_set_entry(-1, 0, index_pt);
-		}
+	if (addr != 0)
+		return addr;
+	
+	if (!isTableActive())
+	{
+		spinlock_acquire(&stealmem_lock);
+		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+		return addr;
 	}
 	
-	if (addr != 0 && isTableActive()) {
-		spinlock_acquire(&freemem_lock);
-		allocSize[addr/PAGE_SIZE] = npages;
-		spinlock_release(&freemem_lock);
+	if (npages == 1)
+	{
+		addr = getzeroedppage();
+		if (addr != 0)
+			return addr;
+	}
+	
+	// Memory is full: user pages chosen by the replacement policy are
+	// evicted (and saved) until there is room. Each eviction frees one
+	// frame, so a large allocation may need several if the freed frames
+	// aren't contiguous. If we can't sleep there is nothing to do.
+	// Nor if we hold a lock of the VM: the eviction may need it (the
+	// I/O lock of a swap device), or would keep it held during its I/O.
+	// The pageout daemon makes room for the next time.
+	if (addr == 0 && curthread->t_vm_locks > 0)
+	{
+		pt_wake_pageout();
+		return 0;
+	}
+	while (addr == 0 && curcpu->c_spinlocks == 0 && !curthread->t_in_interrupt)
+	{
+		if (pt_reclaim())
+			break;
+		increment_COREMAP_reclaims();
+		addr = getfreeppages(npages);
 	}
 
 	return addr;
 }
 
 
-// search for first free page and see if there are any available
-paddr_t getfreeppages(unsigned long npages)
+// Take and release a sleep lock of the VM, counting the ones held by the
+// thread: its allocations don't evict pages meanwhile (see getppages).
+void vm_lock_acquire (struct lock *lk)
 {
-	paddr_t addr;
-	long i, first, found;
-	long np = (long)npages;
+	lock_acquire(lk);
+	curthread->t_vm_locks++;
+}
+
+void vm_lock_release (struct lock *lk)
+{
+	KASSERT(curthread->t_vm_locks > 0);
+	curthread->t_vm_locks--;
+	lock_release(lk);
+}
+
+// refill the magazine of this cpu from the lists, with its lock held
+static void coremap_refill (struct magazine *m)
+{
+	int i, index;
 	
-	if (!isTableActive()) return 0;
+	coremap_lock();
+	for (i = 0; i < COREMAP_BATCH; i++)
+	{
+		index = buddy_alloc(1);
+		if (index < 0)
+			break;
+		m->frames[m->n++] = index;
+		nFreeFrames--;
+	}
+	spinlock_release(&freemem_lock);
+}
+
+// give half of the magazine of this cpu back to the lists, with its lock held
+static void coremap_drain (struct magazine *m)
+{
+	int i;
 	
-	spinlock_acquire(&freemem_lock);
-	// Linear search of free interval
-	for (i=0,first=found=-1; i<nRamFrames; i++) 
+	coremap_lock();
+	for (i = 0; i < COREMAP_BATCH; i++)
 	{
-		if (freeRamFrames[i]) 
+		buddy_free_block(m->frames[--m->n], 0);
+		nFreeFrames++;
+	}
+	spinlock_release(&freemem_lock);
+}
+
+// Give the frames of every magazine back to the lists, where they can be
+// merged and seen by the other cpus. Returns the number of frames moved.
+static int coremap_drain_all (void)
+{
+	struct magazine *m;
+	int i, n = 0;
+	
+	for (i = 0; i < MAXCPUS; i++)
+	{
+		m = &magazines[i];
+		spinlock_acquire(&m->lock);
+		if (m->n > 0)
 		{
-			if (i==0 || !freeRamFrames[i-1])
-				first = i; /* set first free in an interval */
-			if (i-first+1 >= np)
+			coremap_lock();
+			for (; m->n > 0; n++)
 			{
-				found = first;
-				break;
+				buddy_free_block(m->frames[--m->n], 0);
+				nFreeFrames++;
 			}
+			spinlock_release(&freemem_lock);
 		}
+		spinlock_release(&m->lock);
 	}
 	
-	if (found>=0) 
+	return n;
+}
+
+// take npages contiguous free frames from the magazine of this cpu or
+// from the lists, -1 if there aren't any
+static int coremap_alloc (unsigned long npages)
+{
+	struct magazine *m;
+	int found = -1, spl;
+	
+	if (npages == 1)
 	{
-		// update free frame list masking the frames that have been used
-		for (i=found; i<found+np; i++) 
-		{
-			freeRamFrames[i] = (unsigned char)0;
-		}
-		allocSize[found] = np;
-		addr = (paddr_t) found*PAGE_SIZE;
+		spl = splhigh();
+		m = &magazines[curcpu->c_number];
+		spinlock_acquire(&m->lock);
+		if (m->n == 0)
+			coremap_refill(m);
+		if (m->n > 0)
+			found = m->frames[--m->n];
+		spinlock_release(&m->lock);
+		splx(spl);
 	}
-	else 
+	else
 	{
-		addr = 0;
+		coremap_lock();
+		found = buddy_alloc((int)npages);
+		if (found >= 0)
+			nFreeFrames -= npages;
+		spinlock_release(&freemem_lock);
 	}
-	spinlock_release(&freemem_lock);
 	
-	return addr;
+	return found;
+}
+
+// take npages contiguous free frames, 0 if there aren't any
+paddr_t getfreeppages(unsigned long npages)
+{
+	int i, found;
+	
+	if (!isTableActive()) return 0;
+	
+	// The frames in the magazines of the other cpus are free too (and
+	// counted by coremap_get_nfree()), only out of our sight: they go back
+	// to the lists before we fail and make the caller evict a page.
+	found = coremap_alloc(npages);
+	if (found < 0 && coremap_drain_all() > 0)
+		found = coremap_alloc(npages);
+	
+	if (found < 0)
+		return 0;
+	
+	// the frames are ours, nobody else looks at them
+	for (i = 0; i < (int)npages; i++)
+	{
+		frameTable[found + i].state = FRAME_KERNEL;
+		frameTable[found + i].pins = 0;
+	}
+	frameTable[found].prev = npages;
+	return (paddr_t) found*PAGE_SIZE;
+}
+
+// take a free frame for a user page, 0 if only the kernel reserve is left
+paddr_t getuserppage(void)
+{
+	if (coremap_get_nfree() <= COREMAP_RESERVE)
+		return getzeroedppage();
+	
+	return getfreeppages(1);
+}
+
+// wake up the zeroing thread, with zero_lock held
+static void coremap_wake_zero (void)
+{
+	if (zero_sem != NULL && !zero_wanted)
+	{
+		zero_wanted = 1;
+		V(zero_sem);
+	}
+}
+
+// take a frame from the pool of pre-zeroed frames, 0 if it is empty
+paddr_t getzeroedppage(void)
+{
+	int index = -1;
+	
+	spinlock_acquire(&zero_lock);
+	if (nZeroed > 0)
+		index = zeroPool[--nZeroed];
+	if (nZeroed < COREMAP_ZERO_POOL / 2)
+		coremap_wake_zero();
+	spinlock_release(&zero_lock);
+	
+	if (index < 0)
+		return 0;
+	
+	return (paddr_t) index * PAGE_SIZE;
+}
+
+// Fills the pool of pre-zeroed frames, leaving alone the free frames that
+// the faults and the kernel are going to need.
+static void coremap_zero_thread (void *data1, unsigned long data2)
+{
+	paddr_t paddr;
+	
+	(void)data1;
+	(void)data2;
+	
+	while (1)
+	{
+		P(zero_sem);
+		
+		// only this thread adds frames to the pool
+		while (nZeroed < COREMAP_ZERO_POOL &&
+			coremap_get_nfree() > COREMAP_RESERVE + COREMAP_ZERO_POOL)
+		{
+			paddr = getfreeppages(1);
+			if (paddr == 0)
+				break;
+			
+			bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+			
+			spinlock_acquire(&zero_lock);
+			zeroPool[nZeroed++] = paddr / PAGE_SIZE;
+			spinlock_release(&zero_lock);
+			
+			// zeroing is only worth it when nobody else needs the cpu
+			thread_yield();
+		}
+		
+		spinlock_acquire(&zero_lock);
+		zero_wanted = 0;
+		spinlock_release(&zero_lock);
+	}
+}
+
+int coremap_zero_start (void)
+{
+	zero_sem = sem_create("zeropool", 1);
+	if (zero_sem == NULL)
+		return ENOMEM;
+	
+	return thread_fork("zeropool", NULL, coremap_zero_thread, NULL, 0);
 }
 
-// update free frame list when freeing the memory
+// give back the frames allocated from addr, merging them with their buddies
 int freeppages(paddr_t addr)
 {
-	long i, np, first;
+	struct magazine *m;
+	long np, first;
+	int spl;
 	
 	if (!isTableActive()) return 0;
 	
 	first = addr/PAGE_SIZE;
-	np = allocSize[first];
-	KASSERT(allocSize!=NULL);
+	KASSERT(frameTable!=NULL);
 	KASSERT(nRamFrames>first);
+	KASSERT(FRAME_IS(&frameTable[first], FRAME_KERNEL));
 	
+	np = frameTable[first].prev;
+	KASSERT(np > 0);
 	
-	spinlock_acquire(&freemem_lock);
-	// free frames list update
-	for (i=first; i<first+np; i++) 
+	if (np == 1)
 	{
-		freeRamFrames[i] = (unsigned char)1;
+		// free, but not in the lists: no block starts here
+		frameTable[first].order = -1;
+		frameTable[first].state = FRAME_FREE;
+		
+		spl = splhigh();
+		m = &magazines[curcpu->c_number];
+		spinlock_acquire(&m->lock);
+		if (m->n == COREMAP_MAGAZINE)
+			coremap_drain(m);
+		m->frames[m->n++] = first;
+		spinlock_release(&m->lock);
+		splx(spl);
+		return 1;
 	}
+	
+	coremap_lock();
+	buddy_free_range(first, np);
+	nFreeFrames += np;
 	spinlock_release(&freemem_lock);
 	
 	return 1;
 }
+
+// number of free frames, read without locking: it's only a hint
+int coremap_get_nfree(void)
+{
+	int i, n = nFreeFrames;
+	
+	for (i = 0; i < MAXCPUS; i++)
+		n += magazines[i].n;
+	
+	return n;
+}
+
+// count the frames of each kind, for the statistics
+void coremap_get_usage(int *nkernel, int *nuser, int *nfree)
+{
+	int i;
+	
+	*nkernel = *nuser = *nfree = 0;
+	if (!isTableActive())
+		return;
+	
+	for (i = 0; i < nRamFrames; i++)
+	{
+		switch (frameTable[i].state & FRAME_KIND)
+		{
+		    case FRAME_USER:
+			(*nuser)++;
+			break;
+		    case FRAME_FREE:
+			(*nfree)++;
+			break;
+		    default:
+			(*nkernel)++;
+			break;
+		}
+	}
+}
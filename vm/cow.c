@@ -0,0 +1,268 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <synch.h>
+
+#include <cow.h>
+#include <pt.h>
+#include <swapfile.h>
+#include <vmstats.h>
+
+// protects the reference counts, the list and the keys
+static struct spinlock cow_lock = SPINLOCK_INITIALIZER;
+static struct cow *cowList = NULL;
+static pid_t next_key = COW_KEY_MIN;
+
+// held while a shared page is read from the swapfile, so that two
+// processes faulting on it don't load it twice
+static struct lock *cow_load_lock = NULL;
+
+int cow_bootstrap (void)
+{
+	cow_load_lock = lock_create("cow");
+	if (cow_load_lock == NULL)
+		return ENOMEM;
+
+	return 0;
+}
+
+// next key that no live cow is using; called with cow_lock held
+static pid_t cow_new_key (void)
+{
+	struct cow *c;
+	pid_t key;
+
+	do {
+		key = next_key;
+		next_key = (next_key == COW_KEY_MAX) ? COW_KEY_MIN : next_key + 1;
+
+		for (c = cowList; c != NULL && c->key != key; c = c->next);
+	} while (c != NULL);
+
+	return key;
+}
+
+// Move the pages of pid, in memory and in the swapfile, to key. With
+// replace set the pages that key already has at the same addresses are
+// older copies and are dropped.
+static void cow_move_pages (pid_t pid, pid_t key, int replace)
+{
+	vaddr_t vaddr;
+	int i;
+
+	// pages in memory, with their slots if they are clean; each one
+	// leaves the list of pid, the walk always takes the first
+	for (i = -1; pt_owner_next(pid, &i, &vaddr); i = -1)
+	{
+		if (replace)
+		{
+			pt_drop_page(key, vaddr);
+			swapfile_discard(key, vaddr);
+		}
+		pt_rekey_page(pid, key, vaddr);
+		swapfile_rekey(pid, key, vaddr);
+	}
+
+	// pages that are only in the swapfile (or were evicted meanwhile)
+	for (i = -1; swapfile_owner_next(pid, &i, &vaddr); i = -1)
+	{
+		if (replace)
+		{
+			pt_drop_page(key, vaddr);
+			swapfile_discard(key, vaddr);
+		}
+		swapfile_rekey(pid, key, vaddr);
+	}
+}
+
+// Called by the fork of pid, whose pages are shared from now on with the
+// child; below are the pages it already shared. Returns the cow of both
+// (holding a reference for each), NULL if out of memory.
+struct cow *cow_share (pid_t pid, struct cow *below)
+{
+	struct cow *c;
+	unsigned refs;
+
+	if (below != NULL)
+	{
+		spinlock_acquire(&cow_lock);
+		refs = below->refs;
+		spinlock_release(&cow_lock);
+
+		// only the parent sees below: its pages join those
+		if (refs == 1)
+		{
+			cow_move_pages(pid, below->key, 1);
+			cow_ref(below);
+			return below;
+		}
+	}
+
+	c = kmalloc(sizeof(struct cow));
+	if (c == NULL)
+		return NULL;
+
+	spinlock_acquire(&cow_lock);
+	c->key = cow_new_key();
+	c->next = cowList;
+	cowList = c;
+	spinlock_release(&cow_lock);
+
+	// the parent's reference to below is now the new cow's
+	c->refs = 2;
+	c->below = below;
+
+	cow_move_pages(pid, c->key, 0);
+
+	return c;
+}
+
+void cow_ref (struct cow *c)
+{
+	spinlock_acquire(&cow_lock);
+	c->refs++;
+	spinlock_release(&cow_lock);
+}
+
+// drop a reference, the pages that nobody sees anymore are freed
+void cow_release (struct cow *c)
+{
+	struct cow **p;
+	struct cow *below;
+	unsigned refs;
+
+	while (c != NULL)
+	{
+		spinlock_acquire(&cow_lock);
+		KASSERT(c->refs > 0);
+		refs = --c->refs;
+		spinlock_release(&cow_lock);
+
+		if (refs > 0)
+			return;
+
+		pt_discard_owner(c->key);
+		swapfile_discard_owner(c->key);
+
+		// the key can be reused once its pages are gone
+		spinlock_acquire(&cow_lock);
+		for (p = &cowList; *p != c; p = &(*p)->next);
+		*p = c->next;
+		spinlock_release(&cow_lock);
+
+		below = c->below;
+		kfree(c);
+		c = below;
+	}
+}
+
+/*
+ * Fault of pid on a page that isn't one of its own: look for it in the
+ * pages it shares, from top down. Returns 0 if it isn't there, otherwise
+ * 1 with *index_pt the frame to map, pinned:
+ * - a read gets the shared page, that must be mapped read-only;
+ * - a write gets a copy of its own;
+ * - a page that no one else sees anymore is given back to pid.
+ * In the last case, if the page is in the swapfile, 0 is returned too:
+ * the fault goes on as a swap-in of a page of pid.
+ * Returns -1, with nothing pinned, if a frame is needed and memory and
+ * swap are full.
+ */
+int cow_fault (struct cow *top, pid_t pid, vaddr_t vaddr, int write, int *index_pt)
+{
+	struct cow *c;
+	int exclusive = 1;
+	int shared, frame, index_sf;
+
+	for (c = top; c != NULL; c = c->below)
+	{
+		// no lock: refs can't go back to 1 behind us
+		exclusive = exclusive && c->refs == 1;
+
+		if (pt_lookup_pin(c->key, vaddr, &shared))
+		{
+			if (exclusive)
+			{
+				pt_rekey_page(c->key, pid, vaddr);
+				swapfile_rekey(c->key, pid, vaddr);
+				increment_TLB_reloads();
+			}
+			else if (!write)
+			{
+				increment_TLB_reloads();
+			}
+			else
+			{
+				frame = pt_try_get_victim();
+				if (frame < 0)
+				{
+					pt_unpin(shared);
+					return -1;
+				}
+				pt_set_entry(pid, vaddr, frame);
+				memcpy((void *)PADDR_TO_KVADDR((paddr_t) frame * PAGE_SIZE),
+					(void *)PADDR_TO_KVADDR((paddr_t) shared * PAGE_SIZE), PAGE_SIZE);
+				pt_unpin(shared);
+				increment_COW_copies();
+				shared = frame;
+			}
+
+			*index_pt = shared;
+			return 1;
+		}
+
+		if (page_is_in_swapfile(c->key, vaddr, &index_sf))
+		{
+			if (exclusive)
+			{
+				swapfile_rekey(c->key, pid, vaddr);
+				return 0;
+			}
+
+			// a write reads a copy of its own, the slot stays shared
+			if (write)
+			{
+				frame = pt_try_get_victim();
+				if (frame < 0)
+					return -1;
+				pt_set_entry(pid, vaddr, frame);
+				if (read_from_swapfile(index_sf, frame))
+					panic ("Can't read from swapfile\n");
+				increment_PAGE_faults_disk();
+				increment_PAGE_faults_swapfile();
+				*index_pt = frame;
+				return 1;
+			}
+
+			vm_lock_acquire(cow_load_lock);
+			if (pt_lookup_pin(c->key, vaddr, &frame))
+			{
+				// loaded by another process meanwhile
+				vm_lock_release(cow_load_lock);
+				increment_TLB_reloads();
+				*index_pt = frame;
+				return 1;
+			}
+			frame = pt_try_get_victim();
+			if (frame < 0)
+			{
+				vm_lock_release(cow_load_lock);
+				return -1;
+			}
+			pt_set_entry(c->key, vaddr, frame);
+			if (read_from_swapfile(index_sf, frame))
+				panic ("Can't read from swapfile\n");
+			vm_lock_release(cow_load_lock);
+			increment_PAGE_faults_disk();
+			increment_PAGE_faults_swapfile();
+
+			*index_pt = frame;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -7,16 +7,191 @@
 #include <cpu.h>
 #include <spinlock.h>
 #include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <wchan.h>
 #include <mips/tlb.h>
 
 #include <pt.h>
 #include <swapfile.h>
 #include <vmstats.h>
 #include <coremap.h>
+#include <vm_tlb.h>
 
 
 static struct ipt_t *myIpt;
-static int fullPages = 0;
+static int policy = PT_POLICY_FIFO;
+
+/*
+ * The entries of the IPT are the user frames of frameTable (coremap.h),
+ * linked in hash chains by (pid, vaddr).
+ *
+ * Locking: the hash chains are split in PT_NSTRIPES stripes, each with a
+ * spinlock that protects the chains and the entries on them, and a wait
+ * channel for faults on pages that are being evicted. A frame that isn't
+ * on a chain (not a user frame) belongs to whoever got it.
+ * A mapped entry is pinned while a fault loads it or puts it in the TLB,
+ * and busy while it's being evicted; neither can be picked as a victim.
+ * The hands of the replacement policies have their own lock, taken before
+ * the stripe locks.
+ */
+#define PT_NSTRIPES 32
+static struct spinlock pt_stripe[PT_NSTRIPES];
+static struct wchan *pt_wchan[PT_NSTRIPES];
+static struct spinlock pt_hand_lock = SPINLOCK_INITIALIZER;
+
+// frames a hand looks at before letting the other cpus have the lock
+#define PT_HAND_BATCH 32
+
+// pageout daemon
+static struct semaphore *pageout_sem = NULL;
+static int pageout_wanted = 0;
+static int low_water = PT_LOW_WATER;
+static int high_water = PT_HIGH_WATER;
+
+static const char *policy_names[] = { "fifo", "clock", "wsclock" };
+
+// The frames of each owner, linked through owner_next and owner_prev in
+// their descriptors, so that they can be freed when it goes away without
+// looking at all the others. Each process has a list of its own, the keys
+// of shared and text pages (see cow.h and textcache.h) share the others.
+// pt_owner_lock protects the lists, it is taken inside the stripe locks.
+#define PT_OWNER_LISTS 256
+static int ownerHead[PT_OWNER_LISTS];
+static struct spinlock pt_owner_lock = SPINLOCK_INITIALIZER;
+
+// hash of (pid, virtual page number) into the hash anchor table
+static int pt_hash (pid_t pid, vaddr_t vaddr)
+{
+	uint32_t key = (vaddr / PAGE_SIZE) ^ ((uint32_t)pid * 0x9e3779b1);
+	
+	return (int)((key ^ (key >> 16)) & (myIpt->hash_size - 1));
+}
+
+static int pt_stripe_of (pid_t pid, vaddr_t vaddr)
+{
+	return pt_hash(pid, vaddr) % PT_NSTRIPES;
+}
+
+// stripe of an entry whose owner can't change under us: pinned, busy
+// or ours
+static int pt_stripe_of_entry (int index)
+{
+	return pt_stripe_of(frameTable[index].pid, frameTable[index].vaddr);
+}
+
+// Lock the stripe of entry index if it maps a user page and return it,
+// -1 (and nothing locked) otherwise. The entry is checked again once
+// locked because it can be moved meanwhile.
+static int pt_lock_mapped (int index)
+{
+	struct frame *e = &frameTable[index];
+	pid_t pid = e->pid;
+	vaddr_t vaddr = e->vaddr;
+	int s;
+	
+	if (!FRAME_IS(e, FRAME_USER) || pid == -1)
+		return -1;
+	
+	s = pt_stripe_of(pid, vaddr);
+	spinlock_acquire(&pt_stripe[s]);
+	if (!FRAME_IS(e, FRAME_USER) || e->pid != pid || e->vaddr != vaddr)
+	{
+		spinlock_release(&pt_stripe[s]);
+		return -1;
+	}
+	
+	return s;
+}
+
+// walk the chain of (pid, vaddr), with its stripe locked
+static int pt_find (pid_t pid, vaddr_t vaddr)
+{
+	int i;
+	
+	for (i = myIpt->hash[pt_hash(pid, vaddr)]; i != -1; i = frameTable[i].next)
+	{
+		if ((pid == frameTable[i].pid) && (vaddr == frameTable[i].vaddr))
+			return i;
+	}
+	
+	return -1;
+}
+
+// list of the frames of owner
+static int pt_owner_list (pid_t owner)
+{
+	if (owner < MAX_PROCS)
+		return owner;
+	
+	return MAX_PROCS + owner % (PT_OWNER_LISTS - MAX_PROCS);
+}
+
+// put entry index, just mapped, on the list of its owner
+static void pt_owner_add (int index)
+{
+	pid_t pid = frameTable[index].pid;
+	int l;
+	
+	if (pid < 0)
+		return;
+	l = pt_owner_list(pid);
+	
+	spinlock_acquire(&pt_owner_lock);
+	frameTable[index].owner_prev = -1;
+	frameTable[index].owner_next = ownerHead[l];
+	if (ownerHead[l] != -1)
+		frameTable[ownerHead[l]].owner_prev = index;
+	ownerHead[l] = index;
+	spinlock_release(&pt_owner_lock);
+}
+
+static void pt_owner_remove (int index)
+{
+	struct frame *e = &frameTable[index];
+	pid_t pid = e->pid;
+	
+	if (pid < 0)
+		return;
+	
+	spinlock_acquire(&pt_owner_lock);
+	if (e->owner_prev != -1)
+		frameTable[e->owner_prev].owner_next = e->owner_next;
+	else
+		ownerHead[pt_owner_list(pid)] = e->owner_next;
+	if (e->owner_next != -1)
+		frameTable[e->owner_next].owner_prev = e->owner_prev;
+	e->owner_next = e->owner_prev = -1;
+	spinlock_release(&pt_owner_lock);
+}
+
+// remove entry index from its hash chain (if it is in one) and from the
+// list of its owner
+static void pt_unlink (int index)
+{
+	int h, i, prev = -1;
+	
+	if (!FRAME_IS(&frameTable[index], FRAME_USER))
+		return;
+	
+	h = pt_hash(frameTable[index].pid, frameTable[index].vaddr);
+	
+	for (i = myIpt->hash[h]; i != -1; i = frameTable[i].next)
+	{
+		if (i == index)
+		{
+			if (prev == -1)
+				myIpt->hash[h] = frameTable[i].next;
+			else
+				frameTable[prev].next = frameTable[i].next;
+			break;
+		}
+		prev = i;
+	}
+	
+	frameTable[index].next = -1;
+	pt_owner_remove(index);
+}
 
 
 int pt_create(void) 
@@ -34,125 +209,789 @@ int pt_create(void)
 	}
 	
 	
-	myIpt->entry = kmalloc(pt_size*sizeof(struct ipt_t));
+	myIpt->size = pt_size;
+	
+	// one chain head for each frame on average
+	myIpt->hash_size = 1;
+	while (myIpt->hash_size < pt_size)
+		myIpt->hash_size *= 2;
+	
+	myIpt->hash = kmalloc(myIpt->hash_size*sizeof(int));
 	
-	if (myIpt->entry == NULL)
+	if (myIpt->hash == NULL)
 	{
 		return 1;
 	}
 	
-	myIpt->size = pt_size;
+	for (i=0; i < PT_OWNER_LISTS; i++)
+	{
+		ownerHead[i] = -1;
+	}
 	
-	// Initialize page table
-	for (i=0; i < myIpt->size; i++) 
+	// the entries are in frameTable, set up by coremap_bootstrap()
+	for (i=0; i < myIpt->hash_size; i++)
 	{
-		myIpt->entry[i].pid = -1;
-		myIpt->entry[i].vaddr = 0;
+		myIpt->hash[i] = -1;
+	}
+	
+	for (i=0; i < PT_NSTRIPES; i++)
+	{
+		spinlock_init(&pt_stripe[i]);
+		pt_wchan[i] = wchan_create("ipt");
+		if (pt_wchan[i] == NULL)
+			return 1;
 	}
 	
 	return 0;
 }
 
 // returns 1 if it finds the page in the page table along with the physical address
+// only the hash chain of (pid, vaddr) is walked, not the whole table
+// The answer is only a hint, the page can be evicted right after: use
+// pt_lookup_pin() to keep it.
 int page_is_in_mem (pid_t pid, vaddr_t vaddr, int *index)
 {
-	int i;
+	int i, s;
 	
-	for (i = 0; i < myIpt->size; i++)
+	s = pt_stripe_of(pid, vaddr);
+	spinlock_acquire(&pt_stripe[s]);
+	i = pt_find(pid, vaddr);
+	spinlock_release(&pt_stripe[s]);
+	
+	if (i == -1)
+		return 0;
+	
+	// in ipt each entry corresponds to one physical page
+	*index = i;
+	return 1;
+}
+
+// Like page_is_in_mem(), but the page found is pinned until pt_unpin().
+// If it is being evicted we wait for the eviction to end: then the page
+// is in the swapfile.
+int pt_lookup_pin (pid_t pid, vaddr_t vaddr, int *index)
+{
+	int i, s;
+	
+	s = pt_stripe_of(pid, vaddr);
+	spinlock_acquire(&pt_stripe[s]);
+	while ((i = pt_find(pid, vaddr)) != -1 && (frameTable[i].state & FRAME_BUSY))
+		wchan_sleep(pt_wchan[s], &pt_stripe[s]);
+	if (i != -1)
+		frameTable[i].pins++;
+	spinlock_release(&pt_stripe[s]);
+	
+	if (i == -1)
+		return 0;
+	
+	*index = i;
+	return 1;
+}
+
+void pt_unpin (int index)
+{
+	int s = pt_stripe_of_entry(index);
+	
+	spinlock_acquire(&pt_stripe[s]);
+	KASSERT(frameTable[index].pins > 0);
+	frameTable[index].pins--;
+	spinlock_release(&pt_stripe[s]);
+}
+
+// Called with the hand lock held while a hand moves: every PT_HAND_BATCH
+// frames it is dropped for a moment, so that a long scan doesn't keep
+// the other cpus (and the interrupts) waiting until it ends.
+static void pt_hand_yield (int i)
+{
+	if (i > 0 && i % PT_HAND_BATCH == 0)
 	{
-		if ((pid == myIpt->entry[i].pid) && (vaddr == myIpt->entry[i].vaddr))
-		{
-			// in ipt each entry corresponds to one physical page
-			*index =  i;
-			return 1;
-		}
-	}	
+		spinlock_release(&pt_hand_lock);
+		spinlock_acquire(&pt_hand_lock);
+	}
+}
 
-	return 0;
+// Called with the hand lock and the stripe of index held: if the page can
+// be replaced it is marked busy, so nobody else takes it or maps it again.
+static int pt_take_victim (int index)
+{
+	struct frame *e = &frameTable[index];
+	
+	if ((e->state & FRAME_BUSY) || e->pins)
+		return 0;
+	
+	e->state |= FRAME_BUSY;
+	return 1;
 }
 
 // substitutes in order from 0 to myIpt->size
 // since entries are also added in order, this corresponds to FIFO
+// kernel pages, pinned pages and pages being saved are skipped, -1 if there is no victim
 int pt_get_FIFO_victim (void) 
 {
-	int victim;
-	static unsigned int next_victim = 0; // this variable is only initialized once
+	int i, s, victim;
+	static int next_victim = 0; // this variable is only initialized once
 	
-	if (fullPages == 0)
-		fullPages = getFullPages();
+	spinlock_acquire(&pt_hand_lock);
+	for (i = 0; i < myIpt->size; i++)
+	{
+		pt_hand_yield(i);
+		victim = next_victim;
+		next_victim = (next_victim + 1) % myIpt->size;
+		
+		s = pt_lock_mapped(victim);
+		if (s < 0)
+			continue;
+		
+		if (pt_take_victim(victim))
+		{
+			spinlock_release(&pt_stripe[s]);
+			spinlock_release(&pt_hand_lock);
+			return victim;
+		}
+		spinlock_release(&pt_stripe[s]);
+	}
+	spinlock_release(&pt_hand_lock);
 	
-	victim = next_victim + fullPages;
-	next_victim = (next_victim + 1) % (myIpt->size - fullPages);
-	return victim;
+	return -1;
 }
 
-// search first invalid entry (pid == -1) 
-// if none call pt_get_FIFO_victim
-int pt_get_victim (void)
+// second chance: the hand skips (and clears) referenced pages and takes
+// the first one that hasn't been used since its last pass.
+// The reference bit is emulated: clearing it also drops the TLB entry of
+// the page, so that the next access goes through vm_fault and sets it again.
+// Only this cpu's TLB is touched, it's just a hint.
+// With ws set (WSClock) clean pages are preferred, a dirty one is taken
+// only after a whole turn of the clock without clean candidates.
+int pt_get_CLOCK_victim (int ws)
 {
-	int index_pt;
-	paddr_t paddr;
+	static int hand = 0; // this variable is only initialized once
+	struct frame *e;
+	int i, s, index;
+	
+	spinlock_acquire(&pt_hand_lock);
+	
+	// two turns are enough: the first one clears all reference bits
+	for (i = 0; i < 2 * myIpt->size; i++)
+	{
+		pt_hand_yield(i);
+		index = hand;
+		hand = (hand + 1) % myIpt->size;
+		
+		// kernel pages can't be replaced
+		s = pt_lock_mapped(index);
+		if (s < 0)
+			continue;
+		
+		e = &frameTable[index];
+		if ((e->state & FRAME_REF) && !(e->state & FRAME_BUSY))
+		{
+			e->state &= ~FRAME_REF;
+			tlb_invalidate_local(e->pid, e->vaddr);
+		}
+		else if ((!ws || !(e->state & FRAME_DIRTY) || i >= myIpt->size) && pt_take_victim(index))
+		{
+			spinlock_release(&pt_stripe[s]);
+			spinlock_release(&pt_hand_lock);
+			return index;
+		}
+		spinlock_release(&pt_stripe[s]);
+	}
+	
+	spinlock_release(&pt_hand_lock);
+	
+	return -1;
+}
+
+static int pt_select_victim (void)
+{
+	switch (policy) {
+	    case PT_POLICY_CLOCK:
+		return pt_get_CLOCK_victim(0);
+	    case PT_POLICY_WSCLOCK:
+		return pt_get_CLOCK_victim(1);
+	    default:
+		return pt_get_FIFO_victim();
+	}
+}
+
+// Drop the TLB entries of n victims on all cpus. They are busy, so they
+// can't be loaded again in a TLB until their eviction ends.
+static void pt_shootdown (const int *victims, int n)
+{
+	pid_t pids[SWAP_CLUSTER];
+	vaddr_t vaddrs[SWAP_CLUSTER];
+	int i;
+	
+	KASSERT(n <= SWAP_CLUSTER);
+	
+	for (i = 0; i < n; i++)
+	{
+		pids[i] = frameTable[victims[i]].pid;
+		vaddrs[i] = frameTable[victims[i]].vaddr;
+	}
+	
+	tlb_shootdown(pids, vaddrs, n);
+}
+
+// First half of an eviction, the victim is busy and no longer in any TLB.
+// Returns 1 if the page is dirty and must be written; clean pages are
+// still the same as their copy in the swapfile or in the ELF file, or
+// they are zero-filled pages.
+static int pt_evict_start (int index_pt)
+{
+	struct frame *e = &frameTable[index_pt];
+	int s, spec, dirty;
+	
+	s = pt_stripe_of_entry(index_pt);
+	spinlock_acquire(&pt_stripe[s]);
+	KASSERT(e->state & FRAME_BUSY);
+	spec = (e->state & FRAME_SPEC) >> FRAME_SPEC_SHIFT;
+	dirty = e->state & FRAME_DIRTY;
+	e->state &= ~FRAME_DIRTY;
+	spinlock_release(&pt_stripe[s]);
+	
+	// loaded ahead of time but never used
+	if (spec == PT_SPEC_ELF)
+		increment_PREFETCH_misses();
+	else if (spec == PT_SPEC_SWAP)
+		increment_SWAPIN_prefetch_misses();
+	
+	if (!dirty)
+	{
+		increment_SWAPFILE_discards();
+		return 0;
+	}
+	
+	increment_SWAPFILE_writes();
+	
+	return 1;
+}
+
+// Second half of an eviction, once the page has been saved: unmap it and
+// wake up the faults waiting for it, they'll find it in the swapfile.
+static void pt_evict_finish (int index_pt)
+{
+	// no longer over-writable until its new owner sets it
+	pt_set_entry(-1, 0, index_pt);
+}
+
+// The page couldn't be saved because swap is full: it stays where it is,
+// dirty, and the faults waiting for it find it again.
+static void pt_evict_cancel (int index_pt)
+{
+	struct frame *e = &frameTable[index_pt];
+	int s;
+	
+	s = pt_stripe_of_entry(index_pt);
+	spinlock_acquire(&pt_stripe[s]);
+	KASSERT(e->state & FRAME_BUSY);
+	e->state = (e->state | FRAME_DIRTY) & ~FRAME_BUSY;
+	wchan_wakeall(pt_wchan[s], &pt_stripe[s]);
+	spinlock_release(&pt_stripe[s]);
+	
+	increment_SWAP_full();
+}
+
+// Save the page in frame index_pt if it's dirty and unmap it. Returns
+// ENOSPC, with the page still mapped, if swap is full.
+static int pt_evict (int index_pt)
+{
+	int result;
+	
+	pt_shootdown(&index_pt, 1);
+	
+	if (pt_evict_start(index_pt))
+	{
+		result = write_to_swapfile (frameTable[index_pt].pid, frameTable[index_pt].vaddr, index_pt);
+		if (result == ENOSPC)
+		{
+			pt_evict_cancel(index_pt);
+			return result;
+		}
+		if (result)
+			panic ("Can't write to swapfile");
+	}
+	
+	pt_evict_finish(index_pt);
 	
-	// Search for first free page
-	paddr = getfreeppages(1);
+	return 0;
+}
+
+// Write a cluster of dirty pages that are being evicted. They are sorted
+// by (pid, vaddr) and each process's run goes out with a single write,
+// so neighbouring pages end up in neighbouring slots. The pages that
+// don't fit in swap stay in memory and are set to -1 in cluster, returns
+// the number of them.
+static int pt_write_cluster (int *cluster, int n)
+{
+	int result, full = 0;
+	vaddr_t vaddrs[SWAP_CLUSTER];
+	int i, j, first, tmp;
+	struct frame *a, *b;
 	
-	if (paddr!=0)
+	// insertion sort, n is small
+	for (i = 1; i < n; i++)
 	{
-		index_pt = paddr / PAGE_SIZE;
+		for (j = i; j > 0; j--)
+		{
+			a = &frameTable[cluster[j-1]];
+			b = &frameTable[cluster[j]];
+			if (a->pid < b->pid || (a->pid == b->pid && a->vaddr <= b->vaddr))
+				break;
+			tmp = cluster[j-1];
+			cluster[j-1] = cluster[j];
+			cluster[j] = tmp;
+		}
 	}
-	else // Page Replacement
+	
+	for (first = 0; first < n; first = i)
 	{
-		index_pt = pt_get_FIFO_victim();
-		pid_t old_pid = myIpt->entry[index_pt].pid;
-		vaddr_t old_vaddr = myIpt->entry[index_pt].vaddr;
-		uint32_t old_elo, old_ehi;
-		int i;
+		for (i = first; i < n && frameTable[cluster[i]].pid == frameTable[cluster[first]].pid; i++)
+			vaddrs[i - first] = frameTable[cluster[i]].vaddr;
 		
-		increment_SWAPFILE_writes();
-		// Save old page in swapfile
-		if (write_to_swapfile (old_pid, old_vaddr, index_pt))
+		increment_SWAPFILE_clusters();
+		result = write_cluster_to_swapfile(frameTable[cluster[first]].pid, vaddrs, &cluster[first], i - first);
+		if (result == ENOSPC)
+		{
+			for (j = first; j < i; j++)
+			{
+				pt_evict_cancel(cluster[j]);
+				cluster[j] = -1;
+				full++;
+			}
+		}
+		else if (result)
 			panic ("Can't write to swapfile");
+	}
+	
+	return full;
+}
+
+void pt_wake_pageout (void)
+{
+	if (pageout_sem != NULL && !pageout_wanted)
+	{
+		pageout_wanted = 1;
+		V(pageout_sem);
+	}
+}
+
+// Keeps free frames between the low and the high watermark so that page
+// faults only need a page-in. It is woken by pt_try_get_victim() when the
+// number of free frames goes below the low watermark.
+// Victims are taken SWAP_CLUSTER at a time and dropped from the TLBs with
+// one batch of shootdowns. Clean ones are freed right away, dirty ones
+// are written together.
+static void pt_pageout_thread (void *data1, unsigned long data2)
+{
+	int victims[SWAP_CLUSTER];
+	int cluster[SWAP_CLUSTER];
+	int i, n, ndirty, full, index_pt;
+	
+	(void)data1;
+	(void)data2;
+	
+	while (1)
+	{
+		P(pageout_sem);
 		
-		// Invalidate old entry in the TLB if still there
-		for (i=0; i<NUM_TLB; i++) {
-			tlb_read(&old_ehi, &old_elo, i);
-			if (old_ehi == old_vaddr){
-				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		while (coremap_get_nfree() < high_water)
+		{
+			n = 0;
+			while (n < SWAP_CLUSTER && coremap_get_nfree() + n < high_water)
+			{
+				index_pt = pt_select_victim();
+				if (index_pt < 0)
+					break;
+				victims[n++] = index_pt;
+			}
+			
+			if (n == 0)
 				break;
+			
+			pt_shootdown(victims, n);
+			
+			ndirty = 0;
+			for (i = 0; i < n; i++)
+			{
+				if (pt_evict_start(victims[i]))
+				{
+					cluster[ndirty++] = victims[i];
+				}
+				else
+				{
+					pt_evict_finish(victims[i]);
+					increment_PAGEOUT_frames();
+					freeppages((paddr_t) victims[i] * PAGE_SIZE);
+				}
 			}
+			
+			if (ndirty == 0)
+				continue;
+			
+			full = pt_write_cluster(cluster, ndirty);
+			
+			for (i = 0; i < ndirty; i++)
+			{
+				if (cluster[i] < 0)
+					continue;
+				pt_evict_finish(cluster[i]);
+				increment_PAGEOUT_frames();
+				freeppages((paddr_t) cluster[i] * PAGE_SIZE);
+			}
+			
+			// swap is full, the faults will find clean pages or give up
+			if (full)
+				break;
 		}
+		
+		pageout_wanted = 0;
 	}
+}
+
+int pt_pageout_start (void)
+{
+	pageout_sem = sem_create("pageout", 0);
+	if (pageout_sem == NULL)
+		return ENOMEM;
 	
-	return index_pt;
+	return thread_fork("pageout", NULL, pt_pageout_thread, NULL, 0);
 }
 
+// low == 0 turns the pageout daemon off
+int pt_set_watermarks (int low, int high)
+{
+	if (low < 0 || high < low || high >= myIpt->size)
+		return EINVAL;
+	
+	low_water = low;
+	high_water = high;
+	
+	return 0;
+}
 
-void pt_set_entry (pid_t pid, vaddr_t vaddr, int index)
+// 1 if some frame is pinned or being evicted, so it will be free soon
+static int pt_frames_in_use (void)
 {
-	myIpt->entry[index].pid = pid;
-	myIpt->entry[index].vaddr = vaddr;
+	int i;
+	
+	for (i = 0; i < myIpt->size; i++)
+	{
+		if (FRAME_IS(&frameTable[i], FRAME_USER) &&
+			((frameTable[i].state & FRAME_BUSY) || frameTable[i].pins))
+			return 1;
+	}
+	
+	return 0;
 }
 
-vaddr_t pt_get_vaddr (int index)
+// take a free frame if there is one, otherwise ask the replacement
+// policy for a victim and evict it synchronously
+// The frame is returned unmapped, it belongs to the caller. Returns -1
+// if memory and swap are full, or no user page is left to replace.
+int pt_try_get_victim (void)
+{
+	int index_pt, tries = 0;
+	paddr_t paddr;
+	
+	while (1)
+	{
+		// Search for first free page
+		paddr = getuserppage();
+		
+		if (coremap_get_nfree() < low_water)
+			pt_wake_pageout();
+		
+		if (paddr != 0)
+			return paddr / PAGE_SIZE;
+		
+		// Page Replacement
+		index_pt = pt_select_victim();
+		if (index_pt >= 0)
+		{
+			if (pt_evict(index_pt) == 0)
+				return index_pt;
+			
+			// a dirty page and swap is full: look for a clean one, the
+			// policies move on after each victim
+			if (++tries >= myIpt->size)
+				return -1;
+			continue;
+		}
+		
+		// other cpus are faulting or evicting, try again after them;
+		// if the kernel holds all the others there is nothing to replace
+		if (!pt_frames_in_use())
+			return -1;
+		thread_yield();
+	}
+}
+
+// Walk the frames of pid: *index is -1 for the first one, then the last
+// one returned, with its vaddr. If that one has left the list meanwhile
+// (evicted or moved) the walk starts again from the first. Returns 0 at
+// the end, 1 with the next frame and its vaddr otherwise.
+int pt_owner_next (pid_t pid, int *index, vaddr_t *vaddr)
 {
-	return myIpt->entry[index].vaddr;
+	int l = pt_owner_list(pid);
+	int i = *index;
+	
+	spinlock_acquire(&pt_owner_lock);
+	if (i != -1 && (frameTable[i].owner_prev != -1 || ownerHead[l] == i) &&
+		frameTable[i].pid == pid && frameTable[i].vaddr == *vaddr)
+		i = frameTable[i].owner_next;
+	else
+		i = ownerHead[l];
+	for (; i != -1 && frameTable[i].pid != pid; i = frameTable[i].owner_next);
+	if (i != -1)
+		*vaddr = frameTable[i].vaddr;
+	spinlock_release(&pt_owner_lock);
+	
+	*index = i;
+	return i != -1;
 }
 
-pid_t pt_get_pid (int index)
+// Give the page (from, vaddr), if it is in memory, to (to, vaddr), that
+// must not be in memory. An eviction in progress is waited for, then
+// the page is in the swapfile. Returns 1 if the page has been moved.
+int pt_rekey_page (pid_t from, pid_t to, vaddr_t vaddr)
+{
+	int i, h, s, t, first, second;
+	
+	s = pt_stripe_of(from, vaddr);
+	t = pt_stripe_of(to, vaddr);
+	first = s < t ? s : t;
+	second = s < t ? t : s;
+	
+	while (1)
+	{
+		// both chains change, their stripes are taken in order
+		spinlock_acquire(&pt_stripe[first]);
+		if (second != first)
+			spinlock_acquire(&pt_stripe[second]);
+		
+		i = pt_find(from, vaddr);
+		if (i == -1 || !(frameTable[i].state & FRAME_BUSY))
+			break;
+		
+		if (second != first)
+			spinlock_release(&pt_stripe[second]);
+		spinlock_release(&pt_stripe[first]);
+		
+		spinlock_acquire(&pt_stripe[s]);
+		while ((i = pt_find(from, vaddr)) != -1 && (frameTable[i].state & FRAME_BUSY))
+			wchan_sleep(pt_wchan[s], &pt_stripe[s]);
+		spinlock_release(&pt_stripe[s]);
+	}
+	
+	if (i != -1)
+	{
+		KASSERT(pt_find(to, vaddr) == -1);
+		pt_unlink(i);
+		h = pt_hash(to, vaddr);
+		frameTable[i].pid = to;
+		frameTable[i].next = myIpt->hash[h];
+		myIpt->hash[h] = i;
+		pt_owner_add(i);
+	}
+	
+	if (second != first)
+		spinlock_release(&pt_stripe[second]);
+	spinlock_release(&pt_stripe[first]);
+	
+	return i != -1;
+}
+
+// Free the frame of (pid, vaddr) if the page is in memory, after its
+// eviction if one is in progress. Nobody must be using the page.
+void pt_drop_page (pid_t pid, vaddr_t vaddr)
 {
-	return myIpt->entry[index].pid;
+	int i, s;
+	
+	s = pt_stripe_of(pid, vaddr);
+	spinlock_acquire(&pt_stripe[s]);
+	while ((i = pt_find(pid, vaddr)) != -1 && (frameTable[i].state & FRAME_BUSY))
+		wchan_sleep(pt_wchan[s], &pt_stripe[s]);
+	if (i != -1)
+	{
+		KASSERT(frameTable[i].pins == 0);
+		frameTable[i].state |= FRAME_BUSY;
+	}
+	spinlock_release(&pt_stripe[s]);
+	
+	if (i == -1)
+		return;
+	
+	// no TLB can hold it: its owners are gone, or are forking and get
+	// a new asid
+	pt_evict_finish(i);
+	freeppages((paddr_t) i * PAGE_SIZE);
 }
 
-int getFullPages(void)
+// Free all the frames of pid, a process or a key, walking its list.
+void pt_discard_owner (pid_t pid)
 {
+	vaddr_t vaddr;
 	int i;
 	
-	for (i = 0; i < myIpt->size; i++)
+	// pt_drop_page takes the first one off the list (or the eviction in
+	// progress does), and nobody adds pages of an owner that goes away
+	while (1)
 	{
-		if (myIpt->entry[i].pid >= 0 && myIpt->entry[i-1].pid == -1)
-			return i;
+		spinlock_acquire(&pt_owner_lock);
+		for (i = ownerHead[pt_owner_list(pid)]; i != -1 && frameTable[i].pid != pid; i = frameTable[i].owner_next);
+		vaddr = (i == -1) ? 0 : frameTable[i].vaddr;
+		spinlock_release(&pt_owner_lock);
+		
+		if (i == -1)
+			return;
+		pt_drop_page(pid, vaddr);
 	}
+}
+
+// Make room for a kernel allocation when memory is full: evict a victim
+// of the replacement policy and free its frame. Returns 1 if there is
+// nothing that can be evicted.
+int pt_reclaim (void)
+{
+	int index_pt;
 	
-	return myIpt->size;
+	index_pt = pt_select_victim();
+	if (index_pt < 0)
+		return 1;
 	
+	if (pt_evict(index_pt))
+		return 1;
+	freeppages((paddr_t) index_pt * PAGE_SIZE);
+	
+	return 0;
+}
+
+// Map frame index to (pid, vaddr), or unmap it if pid is -1. The frame
+// must be ours (just allocated, victim or just loaded); a mapped entry is returned
+// pinned, pt_unpin() it once the page is loaded and in the TLB.
+void pt_set_entry (pid_t pid, vaddr_t vaddr, int index)
+{
+	struct frame *e = &frameTable[index];
+	int h, s;
+	
+	KASSERT(!FRAME_IS(e, FRAME_FREE));
+	
+	if (FRAME_IS(e, FRAME_USER))
+	{
+		s = pt_stripe_of_entry(index);
+		spinlock_acquire(&pt_stripe[s]);
+		pt_unlink(index);
+		e->state = FRAME_KERNEL;
+		e->pid = -1;
+		e->vaddr = 0;
+		wchan_wakeall(pt_wchan[s], &pt_stripe[s]);
+		spinlock_release(&pt_stripe[s]);
+	}
+	
+	// a kernel frame of its own, until it is mapped
+	e->state = FRAME_KERNEL;
+	e->pins = 0;
+	e->prev = 1;
+	
+	if (pid != -1)
+	{
+		s = pt_stripe_of(pid, vaddr);
+		spinlock_acquire(&pt_stripe[s]);
+		h = pt_hash(pid, vaddr);
+		e->pid = pid;
+		e->vaddr = vaddr;
+		e->pins = 1;
+		e->state = FRAME_USER;
+		e->next = myIpt->hash[h];
+		myIpt->hash[h] = index;
+		pt_owner_add(index);
+		spinlock_release(&pt_stripe[s]);
+	}
+}
+
+// select the replacement policy by name, returns EINVAL if unknown
+int pt_set_policy (const char *name)
+{
+	int i;
+	
+	for (i = 0; i < (int)ARRAYCOUNT(policy_names); i++)
+	{
+		if (!strcmp(name, policy_names[i]))
+		{
+			policy = i;
+			return 0;
+		}
+	}
+	
+	return EINVAL;
+}
+
+const char *pt_get_policy_name (void)
+{
+	return policy_names[policy];
+}
+
+// the flags of a page can be changed by its (pinning) owner and by the
+// replacement policies at the same time
+void pt_set_referenced (int index)
+{
+	int s = pt_stripe_of_entry(index);
+	
+	spinlock_acquire(&pt_stripe[s]);
+	frameTable[index].state |= FRAME_REF;
+	spinlock_release(&pt_stripe[s]);
+}
+
+void pt_set_dirty (int index)
+{
+	int s = pt_stripe_of_entry(index);
+	
+	spinlock_acquire(&pt_stripe[s]);
+	frameTable[index].state |= FRAME_DIRTY;
+	spinlock_release(&pt_stripe[s]);
+}
+
+int pt_get_dirty (int index)
+{
+	return (frameTable[index].state & FRAME_DIRTY) != 0;
+}
+
+void pt_set_spec (int index, int spec)
+{
+	int s = pt_stripe_of_entry(index);
+	
+	spinlock_acquire(&pt_stripe[s]);
+	frameTable[index].state = (frameTable[index].state & ~FRAME_SPEC) |
+		(spec << FRAME_SPEC_SHIFT);
+	spinlock_release(&pt_stripe[s]);
+}
+
+// returns the kind of a speculatively loaded page and marks it as used
+int pt_take_spec (int index)
+{
+	int s = pt_stripe_of_entry(index);
+	int spec;
+	
+	spinlock_acquire(&pt_stripe[s]);
+	spec = (frameTable[index].state & FRAME_SPEC) >> FRAME_SPEC_SHIFT;
+	frameTable[index].state &= ~FRAME_SPEC;
+	spinlock_release(&pt_stripe[s]);
+	
+	return spec;
+}
+
+vaddr_t pt_get_vaddr (int index)
+{
+	return frameTable[index].vaddr;
+}
+
+pid_t pt_get_pid (int index)
+{
+	return frameTable[index].pid;
+}
+
+int pt_get_size (void)
+{
+	return myIpt->size;
 }
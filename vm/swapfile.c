@@ -13,31 +13,375 @@
 #include <uio.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <bitmap.h>
+#include <proc.h>
+#include <device.h>
+#include <synch.h>
 
 #include <swapfile.h>
+#include <zswap.h>
 
 static swapfile_t *mySwapfile;
+static struct bitmap *swapMap; // one bit for each slot, set if in use
+static int *swapHash; // chains of the (pid, vaddr) -> slot index
+static int swapHashSize; // power of 2, no less than the slots
+static unsigned pidHint[MAX_PROCS]; // where the next pages of each process go
+#define SWAP_OWNER_LISTS 256
+static int ownerSlots[SWAP_OWNER_LISTS]; // first slot of each list, see sf_link
+
+// Protects the table, the map, the hints and the list of devices, not the
+// I/O. The pages of a slot are only read by faults of the process that
+// owns it, and slots being written are marked in the map but enter the
+// table afterwards.
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Where the slots are stored. The default is a file, on emu0 through the
+ * emufs vnode layer. A raw disk (lhdN) skips the file system: the slots
+ * of a cluster are sectors in a row, and the uio goes straight to the
+ * driver, since pages are always sector aligned.
+ */
+struct swap_backend
+{
+	const char *name;
+	int (*open)(const char *path, struct vnode **ret, int *nslots);
+	int (*io)(struct vnode *v, struct uio *ku);
+	void (*close)(const char *path, struct vnode *v);
+};
+
+static int sf_file_open (const char *path, struct vnode **ret, int *nslots)
+{
+	char *name;
+	int result;
+	
+	// vfs_open may destroy its argument
+	name = kstrdup(path);
+	if (name == NULL)
+		return ENOMEM;
+	result = vfs_open(name, O_RDWR|O_CREAT, 0, ret);
+	kfree(name);
+	
+	*nslots = SWAP_SIZE / PAGE_SIZE;
+	return result;
+}
+
+static int sf_file_io (struct vnode *v, struct uio *ku)
+{
+	if (ku->uio_rw == UIO_READ)
+		return VOP_READ(v, ku);
+	return VOP_WRITE(v, ku);
+}
+
+static void sf_file_close (const char *path, struct vnode *v)
+{
+	(void)path;
+	vfs_close(v);
+}
+
+static int sf_raw_open (const char *path, struct vnode **ret, int *nslots)
+{
+	struct device *d;
+	int result;
+	
+	result = vfs_swapon(path, ret);
+	if (result)
+		return result;
+	
+	d = (*ret)->vn_data;
+	*nslots = (d->d_blocks * d->d_blocksize) / PAGE_SIZE;
+	return 0;
+}
+
+static int sf_raw_io (struct vnode *v, struct uio *ku)
+{
+	struct device *d = v->vn_data;
+	
+	return DEVOP_IO(d, ku);
+}
+
+static void sf_raw_close (const char *path, struct vnode *v)
+{
+	char name[32];
+	size_t len;
+	
+	// unlike vfs_swapon, vfs_swapoff wants no trailing colon
+	strcpy(name, path);
+	len = strlen(name);
+	if (len > 0 && name[len - 1] == ':')
+		name[len - 1] = 0;
+	
+	vfs_swapoff(name);
+	VOP_DECREF(v);
+}
+
+static const struct swap_backend sf_file = { "file", sf_file_open, sf_file_io, sf_file_close };
+static const struct swap_backend sf_raw = { "raw", sf_raw_open, sf_raw_io, sf_raw_close };
 
-struct vnode* swapfile_node;
-char swapfile_name[] = "emu0:SWAPFILE"; //emu0:SWAPFILE";
+/*
+ * Each device attached holds a range of the slots of the table, given
+ * when it is first attached: swap grows as devices are added, up to
+ * SWAP_TABLE_SIZE slots. Clusters go to the devices with the highest
+ * priority that have room, taking turns among those with the same one,
+ * so that their bandwidth adds up. Each device does one I/O at a time,
+ * the others go on meanwhile.
+ */
+struct swap_device
+{
+	const struct swap_backend *backend;
+	struct vnode *node;
+	char name[SWAP_NAME_MAX];
+	int prio;
+	int active; // 0 once detached, its slots are kept for when it comes back
+	unsigned base; // first slot in the table
+	unsigned nslots;
+	unsigned hint; // no free slot below this one
+	struct lock *io_lock;
+};
+
+static struct swap_device swapDevices[SWAP_MAX_DEVICES];
+static int nSwapDevices = 0;
+static unsigned swapSlots = 0; // slots of the table given to devices
+static int nextDevice = 0; // next turn among devices of the same priority
+
+static int sf_hash (pid_t pid, vaddr_t vaddr)
+{
+	uint32_t key = (vaddr / PAGE_SIZE) ^ ((uint32_t)pid * 0x9e3779b1);
+	
+	return (int)((key ^ (key >> 16)) & (swapHashSize - 1));
+}
+
+// device of slot index_sf
+static struct swap_device *sf_device (int index_sf)
+{
+	int d;
+	
+	for (d = 0; d < nSwapDevices; d++)
+	{
+		if ((unsigned)index_sf >= swapDevices[d].base &&
+			(unsigned)index_sf < swapDevices[d].base + swapDevices[d].nslots)
+			return &swapDevices[d];
+	}
+	
+	panic("swap: slot %d isn't on any device\n", index_sf);
+	return NULL;
+}
+
+// The following helpers are called with swap_lock held
+
+// give slot index_sf back to the bitmap, with its copy in the pool
+static void sf_free (int index_sf)
+{
+	struct swap_device *dev;
+	
+	// a page being written back keeps its slot until the write is over
+	if (zswap_invalidate(index_sf))
+		return;
+	
+	dev = sf_device(index_sf);
+	bitmap_unmark(swapMap, index_sf);
+	if ((unsigned)index_sf < dev->hint)
+		dev->hint = index_sf;
+}
+
+// list of the slots of owner: each process has its own, the keys of the
+// shared pages share the others
+static int sf_owner_list (pid_t owner)
+{
+	if (owner < MAX_PROCS)
+		return owner;
+	
+	return MAX_PROCS + owner % (SWAP_OWNER_LISTS - MAX_PROCS);
+}
+
+// Put slot index_sf, just given to (pid, vaddr), in its hash chain. The
+// slots are also on the list of their owner, so that they can be freed
+// when it goes away without looking at the others.
+static void sf_link (int index_sf, pid_t pid, vaddr_t vaddr)
+{
+	int h = sf_hash(pid, vaddr);
+	int l = sf_owner_list(pid);
+	
+	mySwapfile[index_sf].pid = pid;
+	mySwapfile[index_sf].vaddr = vaddr;
+	mySwapfile[index_sf].next = swapHash[h];
+	swapHash[h] = index_sf;
+	
+	mySwapfile[index_sf].owner_prev = -1;
+	mySwapfile[index_sf].owner_next = ownerSlots[l];
+	if (ownerSlots[l] != -1)
+		mySwapfile[ownerSlots[l]].owner_prev = index_sf;
+	ownerSlots[l] = index_sf;
+}
+
+// remove slot index_sf from its hash chain and from the list of its owner
+static void sf_unlink (int index_sf)
+{
+	swapfile_t *e = &mySwapfile[index_sf];
+	int h, i, prev = -1;
+	
+	if (e->owner_prev != -1)
+		mySwapfile[e->owner_prev].owner_next = e->owner_next;
+	else
+		ownerSlots[sf_owner_list(e->pid)] = e->owner_next;
+	if (e->owner_next != -1)
+		mySwapfile[e->owner_next].owner_prev = e->owner_prev;
+	e->owner_next = e->owner_prev = -1;
+	
+	h = sf_hash(mySwapfile[index_sf].pid, mySwapfile[index_sf].vaddr);
+	
+	for (i = swapHash[h]; i != -1; i = mySwapfile[i].next)
+	{
+		if (i == index_sf)
+		{
+			if (prev == -1)
+				swapHash[h] = mySwapfile[i].next;
+			else
+				mySwapfile[prev].next = mySwapfile[i].next;
+			break;
+		}
+		prev = i;
+	}
+	
+	mySwapfile[index_sf].pid = -1;
+	mySwapfile[index_sf].vaddr = 0;
+	mySwapfile[index_sf].next = -1;
+}
+
+// remove slot index_sf from its hash chain and free it
+static void sf_release (int index_sf)
+{
+	sf_unlink(index_sf);
+	sf_free(index_sf);
+}
+
+// n contiguous free slots of dev, searched from start if it is on dev and
+// then from its lowest free slot; returns the first one or -1 if there is
+// no such run. The map is read 32 slots at a time where they are all used,
+// or all free and not enough to end the run.
+static int sf_alloc_dev (struct swap_device *dev, unsigned start, int n)
+{
+	const uint32_t *map = bitmap_getdata(swapMap);
+	unsigned i, first, end = dev->base + dev->nslots;
+	int pass, len;
+
+	if (start < dev->base || start >= end)
+		start = dev->hint;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+			start = dev->hint;
+
+		for (i = start, len = 0; i < end; i++)
+		{
+			if (i % 32 == 0 && i + 32 <= end)
+			{
+				if (map[i / 32] == 0xffffffff)
+				{
+					len = 0;
+					i += 31;
+					continue;
+				}
+				if (map[i / 32] == 0 && len + 32 < n)
+				{
+					len += 32;
+					i += 31;
+					continue;
+				}
+			}
+
+			if (bitmap_isset(swapMap, i))
+			{
+				len = 0;
+				continue;
+			}
+
+			if (++len == n)
+			{
+				first = i + 1 - n;
+				for (i = first; i < first + n; i++)
+					bitmap_mark(swapMap, i);
+				if (first == dev->hint)
+					dev->hint = first + n;
+				return first;
+			}
+		}
+	}
+
+	return -1;
+}
+
+// n contiguous free slots on one device, the highest priority first and
+// in turns among equals; returns the first one or -1 if there is no room
+static int sf_alloc_run (unsigned start, int n)
+{
+	struct swap_device *dev;
+	unsigned tried = 0;
+	int d, i, best, index_sf;
+
+	while (1)
+	{
+		// highest priority among the devices not tried yet
+		best = -1;
+		for (d = 0; d < nSwapDevices; d++)
+		{
+			if (swapDevices[d].active && !(tried & (1 << d)) &&
+				(best < 0 || swapDevices[d].prio > swapDevices[best].prio))
+				best = d;
+		}
+		if (best < 0)
+			return -1;
+
+		for (i = 0; i < nSwapDevices; i++)
+		{
+			d = (nextDevice + i) % nSwapDevices;
+			dev = &swapDevices[d];
+			if (!dev->active || (tried & (1 << d)) || dev->prio != swapDevices[best].prio)
+				continue;
+
+			tried |= 1 << d;
+			index_sf = sf_alloc_dev(dev, start, n);
+			if (index_sf >= 0)
+			{
+				nextDevice = (d + 1) % nSwapDevices;
+				return index_sf;
+			}
+		}
+	}
+}
 
 int swapfile_create (void)
-{	
+{
 	int i, result;
-		
+
+	for (swapHashSize = 1; swapHashSize < SWAP_TABLE_SIZE; swapHashSize <<= 1);
+
     mySwapfile = (swapfile_t *) kmalloc(sizeof(swapfile_t)*SWAP_TABLE_SIZE);
-    if (mySwapfile == NULL){
+    swapHash = kmalloc(sizeof(int)*swapHashSize);
+    swapMap = bitmap_create(SWAP_TABLE_SIZE);
+    if (mySwapfile == NULL || swapHash == NULL || swapMap == NULL){
         return 1;
     }
-    
+
     for (i=0;i<SWAP_TABLE_SIZE;i++)
 	{
         mySwapfile[i].pid = -1;
 		mySwapfile[i].vaddr = 0;
+		mySwapfile[i].next = -1;
     }
-    
-    
-	result = vfs_open(swapfile_name, O_RDWR|O_CREAT, 0, &swapfile_node);
+
+    for (i=0;i<swapHashSize;i++)
+	{
+		swapHash[i] = -1;
+	}
+	
+	for (i=0;i<SWAP_OWNER_LISTS;i++)
+	{
+		ownerSlots[i] = -1;
+	}
+
+
+	result = swapfile_attach(SWAP_DEFAULT, SWAP_PRIO_DEFAULT);
     if (result)
 	{
 		panic ("Can't open the swapfile");
@@ -47,86 +391,472 @@ int swapfile_create (void)
     return 0;
 }
 
-int page_is_in_swapfile(pid_t pid, vaddr_t vaddr, int *index)
+// the device called name, NULL if none; with swap_lock held
+static struct swap_device *sf_find_device (const char *name)
+{
+	int d;
+
+	for (d = 0; d < nSwapDevices; d++)
+	{
+		if (!strcmp(swapDevices[d].name, name))
+			return &swapDevices[d];
+	}
+
+	return NULL;
+}
+
+/*
+ * Swap to name too, with priority prio: a device alone (e.g. "lhd0:") is
+ * used as a raw disk, anything else is a file. If it is already attached
+ * only its priority changes. A device attached again after being
+ * detached gets its old slots back. Attach and detach are menu commands,
+ * run one at a time.
+ */
+int swapfile_attach (const char *name, int prio)
+{
+	const struct swap_backend *backend;
+	struct swap_device *dev;
+	struct vnode *node;
+	struct lock *io_lock = NULL;
+	const char *colon;
+	int nslots, result;
+
+	if (strlen(name) >= SWAP_NAME_MAX)
+		return ENAMETOOLONG;
+
+	spinlock_acquire(&swap_lock);
+	dev = sf_find_device(name);
+	if (dev != NULL && dev->active)
+	{
+		dev->prio = prio;
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+	if (dev == NULL && (nSwapDevices == SWAP_MAX_DEVICES || swapSlots == SWAP_TABLE_SIZE))
+	{
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	spinlock_release(&swap_lock);
+
+	colon = strchr(name, ':');
+	backend = (colon == NULL || colon[1] == 0) ? &sf_raw : &sf_file;
+
+	if (dev == NULL)
+	{
+		io_lock = lock_create(name);
+		if (io_lock == NULL)
+			return ENOMEM;
+	}
+
+	result = backend->open(name, &node, &nslots);
+	if (result)
+	{
+		if (io_lock != NULL)
+			lock_destroy(io_lock);
+		return result;
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (dev == NULL)
+	{
+		dev = &swapDevices[nSwapDevices];
+		strcpy(dev->name, name);
+		dev->base = swapSlots;
+		dev->nslots = nslots;
+		if (dev->nslots > SWAP_TABLE_SIZE - swapSlots)
+			dev->nslots = SWAP_TABLE_SIZE - swapSlots;
+		dev->hint = dev->base;
+		dev->io_lock = io_lock;
+		swapSlots += dev->nslots;
+		nSwapDevices++;
+	}
+	else if ((unsigned)nslots < dev->nslots)
+	{
+		// not the same device as before
+		spinlock_release(&swap_lock);
+		backend->close(name, node);
+		return EINVAL;
+	}
+	dev->backend = backend;
+	dev->node = node;
+	dev->prio = prio;
+	dev->active = 1;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %s (%s), %u slots, priority %d\n", name, backend->name,
+		dev->nslots, prio);
+
+	return 0;
+}
+
+// stop swapping to name, fails with EBUSY if some page is still there
+int swapfile_detach (const char *name)
+{
+	struct swap_device *dev;
+	unsigned i;
+
+	spinlock_acquire(&swap_lock);
+	dev = sf_find_device(name);
+	if (dev == NULL || !dev->active)
+	{
+		spinlock_release(&swap_lock);
+		return ENOENT;
+	}
+	for (i = dev->base; i < dev->base + dev->nslots; i++)
+	{
+		if (bitmap_isset(swapMap, i))
+		{
+			spinlock_release(&swap_lock);
+			return EBUSY;
+		}
+	}
+	dev->active = 0;
+	spinlock_release(&swap_lock);
+
+	// no slot in use, so no I/O can be going on
+	dev->backend->close(dev->name, dev->node);
+	dev->node = NULL;
+
+	kprintf("swap: %s detached\n", name);
+
+	return 0;
+}
+
+// priority of name, -1 if it isn't attached
+int swapfile_get_priority (const char *name)
+{
+	struct swap_device *dev;
+	int prio = -1;
+
+	spinlock_acquire(&swap_lock);
+	dev = sf_find_device(name);
+	if (dev != NULL && dev->active)
+		prio = dev->prio;
+	spinlock_release(&swap_lock);
+
+	return prio;
+}
+
+void swapfile_print_devices (void)
+{
+	unsigned i, used;
+	int d;
+
+	for (d = 0; d < nSwapDevices; d++)
+	{
+		if (!swapDevices[d].active)
+			continue;
+
+		used = 0;
+		spinlock_acquire(&swap_lock);
+		for (i = swapDevices[d].base; i < swapDevices[d].base + swapDevices[d].nslots; i++)
+			used += bitmap_isset(swapMap, i) ? 1 : 0;
+		spinlock_release(&swap_lock);
+
+		kprintf("%s (%s): priority %d, %u/%u slots used\n", swapDevices[d].name,
+			swapDevices[d].backend->name, swapDevices[d].prio, used, swapDevices[d].nslots);
+	}
+}
+
+// with swap_lock held
+static int sf_find (pid_t pid, vaddr_t vaddr)
 {
 	int i;
 	
-	for (i = 0; i < SWAP_TABLE_SIZE; i++)
+	for (i = swapHash[sf_hash(pid, vaddr)]; i != -1; i = mySwapfile[i].next)
 	{
 		if (mySwapfile[i].pid == pid && mySwapfile[i].vaddr == vaddr)
-		{
-			*index = i;
-			return 1;
-		}
+			return i;
 	}
 	
-	return 0;
+	return -1;
+}
+
+int page_is_in_swapfile(pid_t pid, vaddr_t vaddr, int *index)
+{
+	int i;
+	
+	spinlock_acquire(&swap_lock);
+	i = sf_find(pid, vaddr);
+	spinlock_release(&swap_lock);
+	
+	if (i == -1)
+		return 0;
+	
+	*index = i;
+	return 1;
 }
 
 int read_from_swapfile(int index_sf, int index_pt)
 {
-	int result;
-	struct iovec iov;
+	return read_cluster_from_swapfile(index_sf, &index_pt, 1);
+}
+
+// Reads or writes n contiguous slots of one device, starting from
+// index_sf, from or into n frames with one uio. The device does one I/O
+// at a time, so the sectors of a cluster aren't mixed with others.
+static int sf_io (int index_sf, int *index_pt, int n, enum uio_rw rw)
+{
+	struct swap_device *dev;
+	struct iovec iov[SWAP_CLUSTER];
 	struct uio ku;
+	int i, result;
 	
-	paddr_t paddr = index_pt * PAGE_SIZE;
+	spinlock_acquire(&swap_lock);
+	dev = sf_device(index_sf);
+	spinlock_release(&swap_lock);
+	KASSERT((unsigned)(index_sf + n) <= dev->base + dev->nslots);
 	
-	uio_kinit(&iov, &ku, (void*) PADDR_TO_KVADDR(paddr), PAGE_SIZE, index_sf * PAGE_SIZE, UIO_READ);
-	result = VOP_READ(swapfile_node, &ku);
-	if (result){
-		return result;
+	for (i = 0; i < n; i++)
+	{
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR((paddr_t) index_pt[i] * PAGE_SIZE);
+		iov[i].iov_len = PAGE_SIZE;
 	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)(index_sf - dev->base) * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	
+	vm_lock_acquire(dev->io_lock);
+	result = dev->backend->io(dev->node, &ku);
+	vm_lock_release(dev->io_lock);
+	
+	if (result == 0 && ku.uio_resid != 0)
+		result = ENOEXEC;
+	
+	return result;
+}
+
+// the page of a slot that was in the pool, once the pool needs its room
+int swapfile_write_slot (int index_sf, int index_pt)
+{
+	return sf_io(index_sf, &index_pt, 1, UIO_WRITE);
+}
+
+// give back a slot freed while its page was written back
+void swapfile_free_slot (int index_sf)
+{
+	spinlock_acquire(&swap_lock);
+	sf_free(index_sf);
+	spinlock_release(&swap_lock);
+}
 
-	if (ku.uio_resid!=0){
-		return ENOEXEC;
+// reads n contiguous slots from the devices, one uio for each device
+// they are on
+static int sf_read_run (int index_sf, int *index_pt, int n)
+{
+	struct swap_device *dev;
+	int first;
+	
+	spinlock_acquire(&swap_lock);
+	dev = sf_device(index_sf);
+	spinlock_release(&swap_lock);
+	
+	first = n;
+	if ((unsigned)(index_sf + n) > dev->base + dev->nslots)
+		first = dev->base + dev->nslots - index_sf;
+	
+	if (first < n)
+	{
+		if (sf_io(index_sf, index_pt, first, UIO_READ))
+			return EIO;
+		return sf_read_run(index_sf + first, index_pt + first, n - first);
 	}
 	
-	// clean swapfile_table entry
-	mySwapfile[index_sf].pid = -1;
-	mySwapfile[index_sf].vaddr = 0;
+	return sf_io(index_sf, index_pt, n, UIO_READ);
+}
 
-	return result;
+// Reads n contiguous slots, starting from index_sf, into n frames. The
+// pages in the compressed pool are copied from there, the others are
+// read in runs of the slots in between.
+int read_cluster_from_swapfile(int index_sf, int *index_pt, int n)
+{
+	int i, first;
+	
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	KASSERT(index_sf + n <= SWAP_TABLE_SIZE);
+	
+	// the slots are kept: as long as the pages aren't written the copies in
+	// the swapfile are up to date and the pages can be evicted without I/O
+	
+	for (i = 0, first = 0; i <= n; i++)
+	{
+		if (i < n && !zswap_load(index_sf + i, index_pt[i]))
+			continue;
+		if (i > first && sf_read_run(index_sf + first, index_pt + first, i - first))
+			return EIO;
+		first = i + 1;
+	}
+	
+	return 0;
+}
+
+// owner of a slot, returns 0 if the slot is free or out of the swapfile
+int swapfile_get_owner(int index_sf, pid_t *pid, vaddr_t *vaddr)
+{
+	int found = 0;
+	
+	if (index_sf < 0 || index_sf >= SWAP_TABLE_SIZE)
+		return 0;
+	
+	spinlock_acquire(&swap_lock);
+	if (mySwapfile[index_sf].pid != -1)
+	{
+		*pid = mySwapfile[index_sf].pid;
+		*vaddr = mySwapfile[index_sf].vaddr;
+		found = 1;
+	}
+	spinlock_release(&swap_lock);
+	
+	return found;
 }
 
 int write_to_swapfile (pid_t pid, vaddr_t vaddr, int index_pt)
+{
+	return write_cluster_to_swapfile(pid, &vaddr, &index_pt, 1);
+}
+
+// Writes n pages of the same process into n contiguous slots with one
+// uio, so the swapfile sees one large write instead of n small ones.
+// The pages kept in the compressed pool aren't written at all, the
+// others are written in runs of the slots in between.
+// The slots are searched from the hint of the process, so that pages
+// evicted together (and neighbouring pages, if vaddr is sorted) end up
+// next to each other in the swapfile. Returns ENOSPC if swap is full.
+int write_cluster_to_swapfile (pid_t pid, vaddr_t *vaddr, int *index_pt, int n)
 {
 	int i, result;
-	int index_sf = 0;
-	struct iovec iov;
-	struct uio ku;
-	int found = 0;
+	int index_sf, first;
+	
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	
+	spinlock_acquire(&swap_lock);
+	
+	// a stale copy would shadow the new one
+	for (i = 0; i < n; i++)
+		KASSERT(sf_find(pid, vaddr[i]) == -1);
+	
+	index_sf = sf_alloc_run(pidHint[pid % MAX_PROCS], n);
 	
-	paddr_t paddr = index_pt * PAGE_SIZE;
-	int swapfile_offset = 0;
+	spinlock_release(&swap_lock);
 	
-	for (i = 0; i < SWAP_TABLE_SIZE; i++)
+	if (index_sf < 0)
 	{
-		if (mySwapfile[i].pid == -1)
+		if (n == 1)
+			return ENOSPC;
+		
+		// No room for the whole cluster, one page at a time. All or
+		// nothing: the pages that can't be saved stay in memory, with no
+		// stale copy in swap.
+		for (i = 0; i < n; i++)
 		{
-			index_sf = i;
-			swapfile_offset = i * PAGE_SIZE;
-			found = 1;
-			break;
+			result = write_cluster_to_swapfile(pid, &vaddr[i], &index_pt[i], 1);
+			if (result)
+			{
+				while (i-- > 0)
+					swapfile_discard(pid, vaddr[i]);
+				return result;
+			}
 		}
+		return 0;
+	}
+	
+	result = 0;
+	for (i = 0, first = 0; i <= n && result == 0; i++)
+	{
+		if (i < n && zswap_store(index_sf + i, index_pt[i]))
+			continue;
+		if (i > first)
+			result = sf_io(index_sf + first, index_pt + first, i - first, UIO_WRITE);
+		first = i + 1;
 	}
 	
-	if (!found)
-		panic ("Swapfile is full");
+	spinlock_acquire(&swap_lock);
 	
-	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE, swapfile_offset, UIO_WRITE);
-    result = VOP_WRITE(swapfile_node, &ku);
-	if (result){
+	if (result)
+	{
+		for (i = 0; i < n; i++)
+			sf_free(index_sf + i);
+		spinlock_release(&swap_lock);
 		return result;
 	}
-
-	if (ku.uio_resid!=0){
-		return ENOEXEC;
-	}
 	
 	// update swapfile table
-	mySwapfile[index_sf].pid = pid;
-	mySwapfile[index_sf].vaddr = vaddr;
+	for (i = 0; i < n; i++)
+		sf_link(index_sf + i, pid, vaddr[i]);
+	
+	pidHint[pid % MAX_PROCS] = index_sf + n;
+	
+	spinlock_release(&swap_lock);
+	
+	return 0;
+}
 
-	return result;
+// free the slot of a page that has been written, its copy is stale
+void swapfile_discard (pid_t pid, vaddr_t vaddr)
+{
+	int index_sf;
+	
+	spinlock_acquire(&swap_lock);
+	index_sf = sf_find(pid, vaddr);
+	if (index_sf != -1)
+		sf_release(index_sf);
+	spinlock_release(&swap_lock);
 }
 
+// give the slot of (from, vaddr), if there is one, to (to, vaddr)
+void swapfile_rekey (pid_t from, pid_t to, vaddr_t vaddr)
+{
+	int index_sf;
+	
+	spinlock_acquire(&swap_lock);
+	index_sf = sf_find(from, vaddr);
+	if (index_sf != -1)
+	{
+		KASSERT(sf_find(to, vaddr) == -1);
+		sf_unlink(index_sf);
+		sf_link(index_sf, to, vaddr);
+	}
+	spinlock_release(&swap_lock);
+}
+
+// Walk the slots of pid, as pt_owner_next() does with the frames: *index
+// is -1 for the first one, then the last one returned with its vaddr.
+int swapfile_owner_next (pid_t pid, int *index, vaddr_t *vaddr)
+{
+	int l = sf_owner_list(pid);
+	int i = *index;
+	
+	spinlock_acquire(&swap_lock);
+	if (i != -1 && (mySwapfile[i].owner_prev != -1 || ownerSlots[l] == i) &&
+		mySwapfile[i].pid == pid && mySwapfile[i].vaddr == *vaddr)
+		i = mySwapfile[i].owner_next;
+	else
+		i = ownerSlots[l];
+	for (; i != -1 && mySwapfile[i].pid != pid; i = mySwapfile[i].owner_next);
+	if (i != -1)
+		*vaddr = mySwapfile[i].vaddr;
+	spinlock_release(&swap_lock);
+	
+	*index = i;
+	return i != -1;
+}
+
+// free all the slots of pid, a process or a key, walking its list
+void swapfile_discard_owner (pid_t pid)
+{
+	int i, next;
+	
+	spinlock_acquire(&swap_lock);
+	for (i = ownerSlots[sf_owner_list(pid)]; i != -1; i = next)
+	{
+		next = mySwapfile[i].owner_next;
+		if (mySwapfile[i].pid == pid)
+			sf_release(i);
+	}
+	spinlock_release(&swap_lock);
+}
@@ -0,0 +1,164 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <synch.h>
+#include <vnode.h>
+
+#include <textcache.h>
+#include <pt.h>
+
+// protects the list, the reference counts and the keys
+static struct lock *textcache_lock = NULL;
+static struct textcache *textList = NULL;
+static pid_t next_key = TEXT_KEY_MIN;
+static unsigned idle_clock = 0;
+static int nIdle = 0;
+
+int textcache_bootstrap (void)
+{
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL)
+		return ENOMEM;
+	
+	return 0;
+}
+
+// next key that no cached file is using; called with textcache_lock held
+static pid_t textcache_new_key (void)
+{
+	struct textcache *t;
+	pid_t key;
+	
+	do {
+		key = next_key;
+		next_key = (next_key == TEXT_KEY_MAX) ? TEXT_KEY_MIN : next_key + 1;
+		
+		for (t = textList; t != NULL && t->key != key; t = t->next);
+	} while (t != NULL);
+	
+	return key;
+}
+
+// drop the idle file that has been idle the longest, with its pages;
+// called with textcache_lock held
+static void textcache_drop_oldest (void)
+{
+	struct textcache **p, **oldest = NULL;
+	struct textcache *t;
+	
+	for (p = &textList; *p != NULL; p = &(*p)->next)
+	{
+		if ((*p)->refs == 0 && (oldest == NULL || (*p)->idle < (*oldest)->idle))
+			oldest = p;
+	}
+	KASSERT(oldest != NULL);
+	
+	t = *oldest;
+	*oldest = t->next;
+	nIdle--;
+	
+	pt_discard_owner(t->key);
+	VOP_DECREF(t->v);
+	lock_destroy(t->load_lock);
+	kfree(t);
+}
+
+// The text of a program being loaded: the one already cached for the same
+// segment of the same file, or a new one. Returns it with a reference for
+// the caller, NULL if out of memory.
+struct textcache *textcache_get (struct vnode *v, vaddr_t vbase, off_t offset, size_t size)
+{
+	struct textcache *t;
+	
+	vm_lock_acquire(textcache_lock);
+	
+	for (t = textList; t != NULL; t = t->next)
+	{
+		if (t->v == v && t->vbase == vbase && t->offset == offset && t->size == size)
+		{
+			if (t->refs++ == 0)
+				nIdle--;
+			vm_lock_release(textcache_lock);
+			return t;
+		}
+	}
+	
+	t = kmalloc(sizeof(struct textcache));
+	if (t == NULL)
+	{
+		vm_lock_release(textcache_lock);
+		return NULL;
+	}
+	
+	t->load_lock = lock_create("text");
+	if (t->load_lock == NULL)
+	{
+		kfree(t);
+		vm_lock_release(textcache_lock);
+		return NULL;
+	}
+	
+	VOP_INCREF(v);
+	t->v = v;
+	t->vbase = vbase;
+	t->offset = offset;
+	t->size = size;
+	t->key = textcache_new_key();
+	t->refs = 1;
+	t->idle = 0;
+	t->next = textList;
+	textList = t;
+	
+	vm_lock_release(textcache_lock);
+	
+	return t;
+}
+
+void textcache_ref (struct textcache *t)
+{
+	vm_lock_acquire(textcache_lock);
+	KASSERT(t->refs > 0);
+	t->refs++;
+	vm_lock_release(textcache_lock);
+}
+
+// An address space stops running t. Its pages stay cached, so that the
+// program starts faster next time, until too many files are idle.
+void textcache_release (struct textcache *t)
+{
+	vm_lock_acquire(textcache_lock);
+	
+	KASSERT(t->refs > 0);
+	if (--t->refs == 0)
+	{
+		t->idle = ++idle_clock;
+		if (++nIdle > TEXTCACHE_IDLE)
+			textcache_drop_oldest();
+	}
+	
+	vm_lock_release(textcache_lock);
+}
+
+// Text fault on vaddr. Returns 1 with *index_pt the frame that holds it,
+// pinned. Otherwise returns 0 holding the load lock of t, so that two
+// processes don't load the same page twice: the caller reads the page in
+// a frame owned by t->key and calls textcache_loaded().
+int textcache_lookup (struct textcache *t, vaddr_t vaddr, int *index_pt)
+{
+	vm_lock_acquire(t->load_lock);
+	
+	if (pt_lookup_pin(t->key, vaddr, index_pt))
+	{
+		// loaded by another process meanwhile
+		vm_lock_release(t->load_lock);
+		return 1;
+	}
+	
+	return 0;
+}
+
+void textcache_loaded (struct textcache *t)
+{
+	vm_lock_release(t->load_lock);
+}
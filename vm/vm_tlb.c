@@ -9,14 +9,367 @@
 #include <current.h>
 #include <mips/tlb.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
-int tlb_get_rr_victim(void) 
+#include <vmstats.h>
+
+#define TLB_POLICY_RR 0
+#define TLB_POLICY_RANDOM 1
+#define TLB_POLICY_PLRU 2
+
+static const char *policy_names[] = { "rr", "random", "plru" };
+static int policy = TLB_POLICY_RR;
+
+#define TLB_WORDS (NUM_TLB / 32)
+
+/*
+ * What each cpu knows about its own TLB. Only touched by that cpu with
+ * interrupts off, except for the owner fields that are also protected
+ * by tlb_lock.
+ */
+struct tlb_cpu {
+	// address space loaded in the TLB (0 if none), its process and
+	// the cpu itself, for the shootdowns
+	unsigned asid;
+	pid_t pid;
+	struct cpu *cpu;
+
+	uint32_t valid[TLB_WORDS]; // slots written since the last flush
+	uint32_t used[TLB_WORDS]; // slots filled or written recently (plru)
+	unsigned free; // no free slot below this one
+	unsigned hand; // next slot looked at by rr and plru
+	uint32_t seed; // state of the random policy
+};
+
+static struct tlb_cpu tlbCpu[MAXCPUS];
+
+static struct tlb_cpu *tlb_mine (void)
+{
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &tlbCpu[curcpu->c_number];
+}
+
+static int tlb_test (const uint32_t *set, unsigned index)
+{
+	return (set[index / 32] >> (index % 32)) & 1;
+}
+
+static void tlb_mark (uint32_t *set, unsigned index)
+{
+	set[index / 32] |= (uint32_t)1 << (index % 32);
+}
+
+static void tlb_unmark (uint32_t *set, unsigned index)
+{
+	set[index / 32] &= ~((uint32_t)1 << (index % 32));
+}
+
+// xorshift, good enough to spread the victims
+static unsigned tlb_random_victim (struct tlb_cpu *t)
+{
+	if (t->seed == 0)
+		t->seed = 0x9e3779b9 + curcpu->c_number;
+
+	t->seed ^= t->seed << 13;
+	t->seed ^= t->seed >> 17;
+	t->seed ^= t->seed << 5;
+
+	return t->seed % NUM_TLB;
+}
+
+/*
+ * Pseudo-LRU on the used bits. TLB hits don't trap, so the only uses
+ * the kernel sees are refills and write upgrades: a slot that hasn't
+ * seen one since the bits were last cleared is replaced first.
+ */
+static unsigned tlb_plru_victim (struct tlb_cpu *t)
+{
+	unsigned i, index;
+
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		index = (t->hand + i) % NUM_TLB;
+		if (!tlb_test(t->used, index))
+		{
+			t->hand = (index + 1) % NUM_TLB;
+			return index;
+		}
+	}
+
+	// everything used: start a new round
+	for (i = 0; i < TLB_WORDS; i++)
+		t->used[i] = 0;
+
+	index = t->hand;
+	t->hand = (index + 1) % NUM_TLB;
+	return index;
+}
+
+static unsigned tlb_get_victim (struct tlb_cpu *t)
+{
+	unsigned index;
+
+	switch (policy)
+	{
+		case TLB_POLICY_RANDOM:
+			return tlb_random_victim(t);
+		case TLB_POLICY_PLRU:
+			return tlb_plru_victim(t);
+		default:
+			index = t->hand;
+			t->hand = (index + 1) % NUM_TLB;
+			return index;
+	}
+}
+
+// load a translation in a free slot if there is one, otherwise in the
+// policy's victim; the caller has interrupts off
+void tlb_load (uint32_t ehi, uint32_t elo)
+{
+	struct tlb_cpu *t = tlb_mine();
+	unsigned index;
+
+	for (index = t->free; index < NUM_TLB && tlb_test(t->valid, index); index++);
+
+	if (index < NUM_TLB)
+	{
+		increment_TLB_faults_free();
+		t->free = index + 1;
+	}
+	else
+	{
+		increment_TLB_faults_replace();
+		t->free = NUM_TLB;
+		index = tlb_get_victim(t);
+	}
+
+	tlb_write(ehi, elo, index);
+	tlb_mark(t->valid, index);
+	tlb_mark(t->used, index);
+}
+
+// rewrite the translation of ehi if it is in the TLB (e.g. to make it
+// writable); the caller has interrupts off
+void tlb_update (uint32_t ehi, uint32_t elo)
+{
+	int index;
+
+	index = tlb_probe(ehi, 0);
+	if (index >= 0)
+	{
+		tlb_write(ehi, elo, index);
+		tlb_mark(tlb_mine()->used, index);
+	}
+}
+
+// invalidate the whole TLB of this cpu; the caller has interrupts off
+void tlb_flush (void)
+{
+	struct tlb_cpu *t = tlb_mine();
+	unsigned i;
+
+	for (i = 0; i < NUM_TLB; i++)
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+
+	for (i = 0; i < TLB_WORDS; i++)
+	{
+		t->valid[i] = 0;
+		t->used[i] = 0;
+	}
+	t->free = 0;
+	t->hand = 0;
+}
+
+// drop the TLB entry of vaddr, if there is one, so that the next access faults
+void tlb_invalidate_vaddr(vaddr_t vaddr)
+{
+	struct tlb_cpu *t;
+	int index, spl;
+
+	spl = splhigh();
+	index = tlb_probe(vaddr & PAGE_FRAME, 0);
+	if (index >= 0)
+	{
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+
+		t = tlb_mine();
+		tlb_unmark(t->valid, index);
+		tlb_unmark(t->used, index);
+		if ((unsigned)index < t->free)
+			t->free = index;
+	}
+	splx(spl);
+}
+
+int tlb_set_policy (const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int)ARRAYCOUNT(policy_names); i++)
+	{
+		if (!strcmp(name, policy_names[i]))
+		{
+			policy = i;
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+
+const char *tlb_get_policy_name (void)
+{
+	return policy_names[policy];
+}
+
+/*
+ * MIPS-161 ignores the TLBHI_PID field, so the TLB can't hold the
+ * translations of several address spaces at once. Instead every cpu
+ * remembers the address space it last loaded and as_activate flushes
+ * the TLB only when a different one comes in; a process that gets the
+ * cpu back keeps its translations.
+ *
+ * pidCpus tells which cpus may still hold translations of a pid, they
+ * are the ones that get a shootdown when one of its pages is unmapped.
+ * Pages shared copy-on-write and text pages are owned by a key above
+ * the pids (see cow.h and textcache.h) and can be in the TLB of any
+ * process: their shootdowns go to every cpu.
+ */
+static struct spinlock tlb_lock = SPINLOCK_INITIALIZER;
+static unsigned next_asid = 1; // 0 means no address space
+static uint32_t pidCpus[MAX_PROCS]; // one bit for each cpu whose TLB holds the pid
+
+unsigned tlb_new_asid(void)
+{
+	unsigned asid;
+
+	spinlock_acquire(&tlb_lock);
+	asid = next_asid++;
+	spinlock_release(&tlb_lock);
+
+	return asid;
+}
+
+// make asid the owner of this cpu's TLB, returns 1 if it must be flushed
+int tlb_set_owner(unsigned asid, pid_t pid)
+{
+	struct tlb_cpu *t = tlb_mine();
+	unsigned number = curcpu->c_number;
+	int flush;
+
+	spinlock_acquire(&tlb_lock);
+	flush = (t->asid != asid);
+	if (flush) {
+		if (t->asid != 0)
+			pidCpus[t->pid % MAX_PROCS] &= ~((uint32_t)1 << number);
+		t->asid = asid;
+		t->pid = pid;
+		t->cpu = curcpu->c_self;
+		pidCpus[pid % MAX_PROCS] |= (uint32_t)1 << number;
+	}
+	spinlock_release(&tlb_lock);
+
+	return flush;
+}
+
+// drop the translation of a page of pid from this cpu's TLB, if it holds it
+void tlb_invalidate_local(pid_t pid, vaddr_t vaddr)
 {
-	int victim;
-	static unsigned int next_victim = 0; // this variable is only initialized once
-	victim = next_victim;
-	next_victim = (next_victim + 1) % NUM_TLB;
-	return victim;
+	int spl;
+
+	spl = splhigh();
+	if (tlb_mine()->asid != 0 && (pid >= MAX_PROCS || tlb_mine()->pid == pid))
+		tlb_invalidate_vaddr(vaddr);
+	splx(spl);
 }
 
+/*
+ * Drop the translations of n pages from every TLB that may hold them and
+ * wait until it's done. The pages must not be reloaded meanwhile (they
+ * are being evicted and vm_fault waits for them). Each other cpu gets the
+ * whole batch in its shootdown queue and acks the last one. We may wait
+ * for other cpus, so no spinlock can be held.
+ */
+void tlb_shootdown(const pid_t *pid, const vaddr_t *vaddr, int n)
+{
+	struct tlbshootdown_wait wait;
+	struct tlbshootdown ts;
+	uint32_t cpus = 0;
+	unsigned c;
+	int i, done;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	if (n == 0)
+		return;
+
+	// holding the spinlock keeps us on this cpu: it is left out of the
+	// shootdowns because it is done here
+	spinlock_acquire(&tlb_lock);
+	for (i = 0; i < n; i++)
+	{
+		cpus |= (pid[i] >= MAX_PROCS) ? ~(uint32_t)0 : pidCpus[pid[i]];
+		tlb_invalidate_local(pid[i], vaddr[i]);
+	}
+	cpus &= ~((uint32_t)1 << curcpu->c_number);
+	spinlock_release(&tlb_lock);
+
+	if (cpus == 0)
+		return;
+
+	spinlock_init(&wait.lock);
+	wait.pending = 0;
+
+	for (c = 0; c < MAXCPUS; c++)
+	{
+		// cpus that never ran a process have nothing to drop
+		if (!(cpus & ((uint32_t)1 << c)) || tlbCpu[c].cpu == NULL)
+			continue;
 
+		spinlock_acquire(&wait.lock);
+		wait.pending++;
+		spinlock_release(&wait.lock);
+
+		for (i = 0; i < n; i++)
+		{
+			ts.ts_pid = pid[i];
+			ts.ts_vaddr = vaddr[i];
+			ts.ts_wait = (i == n - 1) ? &wait : NULL;
+			ipi_tlbshootdown(tlbCpu[c].cpu, &ts);
+		}
+		increment_TLB_shootdowns();
+	}
+
+	do {
+		spinlock_acquire(&wait.lock);
+		done = (wait.pending == 0);
+		spinlock_release(&wait.lock);
+	} while (!done);
+
+	spinlock_cleanup(&wait.lock);
+}
+
+// a cpu handled the last shootdown of a batch, called in its interrupt
+void tlb_shootdown_done(struct tlbshootdown_wait *wait)
+{
+	spinlock_acquire(&wait->lock);
+	KASSERT(wait->pending > 0);
+	wait->pending--;
+	spinlock_release(&wait->lock);
+}
+
+// the address space is being destroyed, this cpu no longer holds it
+void tlb_forget(unsigned asid)
+{
+	struct tlb_cpu *t;
+
+	// holding the spinlock keeps us on this cpu
+	spinlock_acquire(&tlb_lock);
+	t = tlb_mine();
+	if (t->asid == asid) {
+		pidCpus[t->pid % MAX_PROCS] &= ~((uint32_t)1 << curcpu->c_number);
+		t->asid = 0;
+		t->pid = -1;
+	}
+	spinlock_release(&tlb_lock);
+}
@@ -4,101 +4,413 @@
 #include <vm.h>
 #include <proc.h>
 #include <cpu.h>
+#include <spl.h>
 #include <current.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
 
 #include <vmstats.h>
+#include <pt.h>
+#include <vm_tlb.h>
+#include <coremap.h>
 
 /*
 	TLB_faults_free + TLB_faults_replace = TLB_faults;
-	TLB_reloads + PAGE_faults_zeroed + PAGE_faults_disk = TLB_faults;
+	TLB_reloads + PAGE_faults_zeroed + PAGE_faults_disk + COW_copies + OOM_kills = TLB_faults;
 	PAGE_faults_elf + PAGE_faults_swapfile = PAGE_faults_disk;
+	TLB_invalidations <= TLB_activations;
+	ZERO_pool_hits + ZERO_pool_misses + ZERO_frame_maps = PAGE_faults_zeroed;
 */
 
-static int TLB_faults = 0;
-static int TLB_faults_free = 0;
-static int TLB_faults_replace = 0;
-static int TLB_invalidations = 0;
-static int TLB_reloads = 0;
-static int PAGE_faults_zeroed = 0;
-static int PAGE_faults_disk = 0;
-static int PAGE_faults_elf = 0;
-static int PAGE_faults_swapfile = 0;
-static int SWAPFILE_writes = 0;
+// the counters, each cpu counts its own events and print_vmstats() sums them
+enum {
+	TLB_faults,
+	TLB_faults_free,
+	TLB_faults_replace,
+	TLB_invalidations,
+	TLB_activations,
+	TLB_shootdowns,
+	TLB_reloads,
+	PAGE_faults_zeroed,
+	PAGE_faults_disk,
+	PAGE_faults_elf,
+	PAGE_faults_swapfile,
+	SWAPFILE_writes,
+	SWAPFILE_discards,
+	SWAPFILE_clusters,
+	PAGE_dirtied,
+	PAGEOUT_frames,
+	COREMAP_locks,
+	COREMAP_contention,
+	COREMAP_reclaims,
+	ZERO_pool_hits,
+	ZERO_pool_misses,
+	ZERO_frame_maps,
+	COW_copies,
+	SWAP_full,
+	OOM_kills,
+	ZSWAP_stores,
+	ZSWAP_bytes, // compressed size of the stores
+	ZSWAP_same,
+	ZSWAP_rejects,
+	ZSWAP_hits,
+	ZSWAP_writebacks,
+	PREFETCH_pages,
+	PREFETCH_hits,
+	PREFETCH_misses,
+	SWAPIN_prefetch_pages,
+	SWAPIN_prefetch_hits,
+	SWAPIN_prefetch_misses,
+	PAGE_fault_latency_count,
+	NSTATS
+};
+
+// page fault latency histogram, bucket i counts latencies below 2^i us
+#define LATENCY_BUCKETS 24
+
+// Only touched by its cpu with interrupts off: counting takes no lock and
+// the cpus don't share the cache lines of the counters.
+struct vmstats_cpu {
+	int count[NSTATS];
+	int latency[LATENCY_BUCKETS];
+};
+
+static struct vmstats_cpu statsCpu[MAXCPUS];
+
+static void stat_add (int which, int n)
+{
+	int spl;
+	
+	spl = splhigh();
+	statsCpu[curcpu->c_number].count[which] += n;
+	splx(spl);
+}
+
+// sum of a counter over the cpus, read without locking
+static int stat_get (int which)
+{
+	int i, n = 0;
+	
+	for (i = 0; i < MAXCPUS; i++)
+		n += statsCpu[i].count[which];
+	
+	return n;
+}
 
 
 void increment_TLB_faults (void)
 {
-	TLB_faults++;
+	stat_add(TLB_faults, 1);
 }
 
 void increment_TLB_faults_free (void)
 {
-	TLB_faults_free++;
+	stat_add(TLB_faults_free, 1);
 }
 
 void increment_TLB_faults_replace (void)
 {
-	TLB_faults_replace++;
+	stat_add(TLB_faults_replace, 1);
 }
 
 void increment_TLB_invalidations (void)
 {
-	TLB_invalidations++;
+	stat_add(TLB_invalidations, 1);
+}
+
+void increment_TLB_activations (void)
+{
+	stat_add(TLB_activations, 1);
+}
+
+void increment_TLB_shootdowns (void)
+{
+	stat_add(TLB_shootdowns, 1);
 }
 
 void increment_TLB_reloads (void)
 {
-	TLB_reloads++;
+	stat_add(TLB_reloads, 1);
 }
 
 void increment_PAGE_faults_zeroed (void)
 {
-	PAGE_faults_zeroed++;
+	stat_add(PAGE_faults_zeroed, 1);
 }
 
 void increment_PAGE_faults_disk (void)
 {
-	PAGE_faults_disk++;
+	stat_add(PAGE_faults_disk, 1);
 }
 
 void increment_PAGE_faults_elf (void)
 {
-	PAGE_faults_elf++;
+	stat_add(PAGE_faults_elf, 1);
 }
 
 void increment_PAGE_faults_swapfile (void)
 {
-	PAGE_faults_swapfile++;
+	stat_add(PAGE_faults_swapfile, 1);
 }
 
 void increment_SWAPFILE_writes (void)
 {
-	SWAPFILE_writes++;
+	stat_add(SWAPFILE_writes, 1);
+}
+
+void increment_SWAPFILE_discards (void)
+{
+	stat_add(SWAPFILE_discards, 1);
+}
+
+void increment_SWAPFILE_clusters (void)
+{
+	stat_add(SWAPFILE_clusters, 1);
+}
+
+void increment_PAGE_dirtied (void)
+{
+	stat_add(PAGE_dirtied, 1);
+}
+
+void increment_PAGEOUT_frames (void)
+{
+	stat_add(PAGEOUT_frames, 1);
+}
+
+void increment_COREMAP_locks (void)
+{
+	stat_add(COREMAP_locks, 1);
+}
+
+void increment_COREMAP_contention (void)
+{
+	stat_add(COREMAP_contention, 1);
+}
+
+void increment_COREMAP_reclaims (void)
+{
+	stat_add(COREMAP_reclaims, 1);
+}
+
+void increment_ZERO_pool_hits (void)
+{
+	stat_add(ZERO_pool_hits, 1);
+}
+
+void increment_ZERO_pool_misses (void)
+{
+	stat_add(ZERO_pool_misses, 1);
+}
+
+void increment_ZERO_frame_maps (void)
+{
+	stat_add(ZERO_frame_maps, 1);
+}
+
+void increment_COW_copies (void)
+{
+	stat_add(COW_copies, 1);
+}
+
+int get_COW_copies (void)
+{
+	return stat_get(COW_copies);
+}
+
+void increment_SWAP_full (void)
+{
+	stat_add(SWAP_full, 1);
+}
+
+void increment_OOM_kills (void)
+{
+	stat_add(OOM_kills, 1);
+}
+
+// a page compressed into len bytes of the pool
+void record_ZSWAP_store (int len)
+{
+	stat_add(ZSWAP_stores, 1);
+	stat_add(ZSWAP_bytes, len);
+}
+
+void increment_ZSWAP_same (void)
+{
+	stat_add(ZSWAP_same, 1);
+}
+
+void increment_ZSWAP_rejects (void)
+{
+	stat_add(ZSWAP_rejects, 1);
+}
+
+void increment_ZSWAP_hits (void)
+{
+	stat_add(ZSWAP_hits, 1);
+}
+
+void increment_ZSWAP_writebacks (void)
+{
+	stat_add(ZSWAP_writebacks, 1);
+}
+
+void increment_PREFETCH_pages (void)
+{
+	stat_add(PREFETCH_pages, 1);
+}
+
+void increment_PREFETCH_hits (void)
+{
+	stat_add(PREFETCH_hits, 1);
+}
+
+void increment_PREFETCH_misses (void)
+{
+	stat_add(PREFETCH_misses, 1);
+}
+
+void increment_SWAPIN_prefetch_pages (void)
+{
+	stat_add(SWAPIN_prefetch_pages, 1);
+}
+
+void increment_SWAPIN_prefetch_hits (void)
+{
+	stat_add(SWAPIN_prefetch_hits, 1);
+}
+
+void increment_SWAPIN_prefetch_misses (void)
+{
+	stat_add(SWAPIN_prefetch_misses, 1);
+}
+
+// called at the end of a page fault with the time it started
+void record_PAGE_fault_latency (const struct timespec *start)
+{
+	struct timespec now, duration;
+	uint64_t us;
+	int i, spl;
+	
+	gettime(&now);
+	timespec_sub(&now, start, &duration);
+	us = (uint64_t)duration.tv_sec * 1000000 + duration.tv_nsec / 1000;
+	
+	for (i = 0; i < LATENCY_BUCKETS - 1 && us >= ((uint64_t)1 << i); i++);
+	
+	spl = splhigh();
+	statsCpu[curcpu->c_number].latency[i]++;
+	statsCpu[curcpu->c_number].count[PAGE_fault_latency_count]++;
+	splx(spl);
+}
+
+// snapshot of the TLB counters, for the benchmarks
+void get_TLB_counters (int *faults, int *activations, int *invalidations)
+{
+	*faults = stat_get(TLB_faults);
+	*activations = stat_get(TLB_activations);
+	*invalidations = stat_get(TLB_invalidations);
+}
+
+// upper bound (in us) of the latency of percent% of the page faults,
+// given the histogram summed over the cpus
+static unsigned long latency_percentile (const int *latency, int count, int percent)
+{
+	int i, sum = 0;
+	
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++)
+	{
+		sum += latency[i];
+		if (sum * 100 >= count * percent)
+			break;
+	}
+	
+	return 1UL << i;
 }
 
 void print_vmstats (void)
 {
+	int nkernel, nuser, nfree;
+	int v[NSTATS], latency[LATENCY_BUCKETS];
+	int i, c;
+	
+	coremap_get_usage(&nkernel, &nuser, &nfree);
+	
+	// one snapshot of the counters, for the sums to be checked below
+	for (i = 0; i < NSTATS; i++)
+		v[i] = stat_get(i);
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		latency[i] = 0;
+		for (c = 0; c < MAXCPUS; c++)
+			latency[i] += statsCpu[c].latency[i];
+	}
+	
 	kprintf ("\n-------------------STATISTICS-------------------\n\n");
-	kprintf ("The number of TLB Faults is: %d\n", TLB_faults);
-	kprintf ("The number of TLB Faults with Free is: %d\n", TLB_faults_free);
-	kprintf ("The number of TLB Faults with Replace is: %d\n", TLB_faults_replace);
-	kprintf ("The number of TLB Invalidations is: %d\n", TLB_invalidations);
-	kprintf ("The number of TLB Reloads is: %d\n", TLB_reloads);
-	kprintf ("The number of Page Faults (Zeroed) is: %d\n", PAGE_faults_zeroed);
-	kprintf ("The number of Page Faults (Disk) is: %d\n", PAGE_faults_disk);
-	kprintf ("The number of Page Faults from ELF is: %d\n", PAGE_faults_elf);
-	kprintf ("The number of Page Faults from Swapfile is: %d\n", PAGE_faults_swapfile);
-	kprintf ("The number of Swapfile Writes is: %d\n", SWAPFILE_writes);
-	
-	if ((TLB_faults_free + TLB_faults_replace) != TLB_faults)
+	kprintf ("The page replacement policy is: %s\n", pt_get_policy_name());
+	kprintf ("The TLB replacement policy is: %s\n", tlb_get_policy_name());
+	kprintf ("The number of TLB Faults is: %d\n", v[TLB_faults]);
+	kprintf ("The number of TLB Faults with Free is: %d\n", v[TLB_faults_free]);
+	kprintf ("The number of TLB Faults with Replace is: %d\n", v[TLB_faults_replace]);
+	kprintf ("The number of TLB Invalidations is: %d\n", v[TLB_invalidations]);
+	kprintf ("The number of address space activations is: %d\n", v[TLB_activations]);
+	kprintf ("The number of TLB flushes avoided is: %d\n", v[TLB_activations] - v[TLB_invalidations]);
+	kprintf ("The number of TLB shootdowns sent to other cpus is: %d\n", v[TLB_shootdowns]);
+	kprintf ("The number of TLB Reloads is: %d\n", v[TLB_reloads]);
+	kprintf ("The number of Page Faults (Zeroed) is: %d\n", v[PAGE_faults_zeroed]);
+	kprintf ("The number of zero-fill faults served pre-zeroed (hits) is: %d\n", v[ZERO_pool_hits]);
+	kprintf ("The number of zero-fill faults zeroed on the spot (misses) is: %d\n", v[ZERO_pool_misses]);
+	kprintf ("The number of zero-fill reads mapped to the shared zero frame is: %d\n", v[ZERO_frame_maps]);
+	kprintf ("The number of Page Faults (Disk) is: %d\n", v[PAGE_faults_disk]);
+	kprintf ("The number of shared pages copied on write is: %d\n", v[COW_copies]);
+	kprintf ("The number of Page Faults from ELF is: %d\n", v[PAGE_faults_elf]);
+	kprintf ("The number of Page Faults from Swapfile is: %d\n", v[PAGE_faults_swapfile]);
+	kprintf ("The number of Swapfile Writes is: %d\n", v[SWAPFILE_writes]);
+	kprintf ("The number of pages kept in memory because swap was full is: %d\n", v[SWAP_full]);
+	kprintf ("The number of processes killed for lack of memory and swap is: %d\n", v[OOM_kills]);
+	kprintf ("The number of pages swapped out compressed in memory is: %d\n", v[ZSWAP_stores]);
+	if (v[ZSWAP_stores] > 0)
+		kprintf ("The compression ratio of those pages is: %d.%02d\n",
+			(int)((long long)v[ZSWAP_stores] * PAGE_SIZE / v[ZSWAP_bytes]),
+			(int)((long long)v[ZSWAP_stores] * PAGE_SIZE * 100 / v[ZSWAP_bytes] % 100));
+	kprintf ("The number of same-filled pages swapped out as a flag is: %d\n", v[ZSWAP_same]);
+	kprintf ("The number of pages that didn't compress or fit in the pool is: %d\n", v[ZSWAP_rejects]);
+	kprintf ("The number of pages written back from the pool is: %d\n", v[ZSWAP_writebacks]);
+	kprintf ("The number of pages read from the pool (hits) is: %d\n", v[ZSWAP_hits]);
+	kprintf ("The number of clustered Swapfile Writes is: %d\n", v[SWAPFILE_clusters]);
+	kprintf ("The number of clean pages replaced without writes is: %d\n", v[SWAPFILE_discards]);
+	kprintf ("The number of pages dirtied is: %d\n", v[PAGE_dirtied]);
+	kprintf ("The number of frames freed by the pageout daemon is: %d\n", v[PAGEOUT_frames]);
+	kprintf ("The number of coremap lock acquisitions is: %d\n", v[COREMAP_locks]);
+	kprintf ("The number of them that found it held by another cpu is: %d\n", v[COREMAP_contention]);
+	kprintf ("The number of user pages evicted for kernel allocations is: %d\n", v[COREMAP_reclaims]);
+	kprintf ("The number of kernel / user / free frames is: %d / %d / %d\n", nkernel, nuser, nfree);
+	kprintf ("The number of pages prefetched from ELF is: %d\n", v[PREFETCH_pages]);
+	kprintf ("The number of prefetched pages used (hits) is: %d\n", v[PREFETCH_hits]);
+	kprintf ("The number of prefetched pages replaced unused (misses) is: %d\n", v[PREFETCH_misses]);
+	kprintf ("The number of pages read ahead from Swapfile is: %d\n", v[SWAPIN_prefetch_pages]);
+	kprintf ("The number of read-ahead pages used (hits) is: %d\n", v[SWAPIN_prefetch_hits]);
+	kprintf ("The number of read-ahead pages replaced unused (misses) is: %d\n", v[SWAPIN_prefetch_misses]);
+	
+	if (v[PAGE_fault_latency_count] > 0)
+	{
+		kprintf ("The 50th percentile of page fault latency is: < %lu us\n", latency_percentile(latency, v[PAGE_fault_latency_count], 50));
+		kprintf ("The 90th percentile of page fault latency is: < %lu us\n", latency_percentile(latency, v[PAGE_fault_latency_count], 90));
+		kprintf ("The 99th percentile of page fault latency is: < %lu us\n", latency_percentile(latency, v[PAGE_fault_latency_count], 99));
+	}
+	
+	if ((v[TLB_faults_free] + v[TLB_faults_replace]) != v[TLB_faults])
 		kprintf ("WARNING: the sum of TLB Faults with Free and TLB Faults with Reload isn't correct\n");
 	
-	if ((TLB_reloads + PAGE_faults_zeroed + PAGE_faults_disk) != TLB_faults)
-		kprintf ("WARNING: the sum of TLB Reloads, Page Faults (Zeroed) and Page Faults (Disk) isn't correct\n");	
+	if ((v[TLB_reloads] + v[PAGE_faults_zeroed] + v[PAGE_faults_disk] + v[COW_copies] + v[OOM_kills]) != v[TLB_faults])
+		kprintf ("WARNING: the sum of TLB Reloads, Page Faults (Zeroed), Page Faults (Disk), copies on write and kills isn't correct\n");	
 	
-	if ((PAGE_faults_elf + PAGE_faults_swapfile) != PAGE_faults_disk)
+	if ((v[PAGE_faults_elf] + v[PAGE_faults_swapfile]) != v[PAGE_faults_disk])
 		kprintf ("WARNING: the sum of Page Faults from ELF and Page Faults from Swapfile isn't correct\n");
 	
+	if ((v[ZERO_pool_hits] + v[ZERO_pool_misses] + v[ZERO_frame_maps]) != v[PAGE_faults_zeroed])
+		kprintf ("WARNING: the sum of zero-fill pool hits, misses and zero frame maps isn't correct\n");
+	
 	kprintf ("\n------------------------------------------------\n\n");
 }
 
@@ -0,0 +1,482 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <spinlock.h>
+#include <synch.h>
+
+#include <coremap.h>
+#include <swapfile.h>
+#include <vmstats.h>
+#include <zswap.h>
+
+// where the page of a slot is
+#define ZS_NONE 0 // on the device (or the slot is free)
+#define ZS_SAME 1 // nowhere: all its words are fill
+#define ZS_COMP 2 // compressed in the pool
+#define ZS_WRITEBACK 3 // compressed in the pool, being written to the device
+#define ZS_DEAD 4 // slot freed during the write-back, given back once it ends
+
+#define ZS_NCHUNKS (ZSWAP_POOL_PAGES * PAGE_SIZE / ZSWAP_CHUNK)
+
+struct zswap_entry
+{
+	uint8_t state;
+	uint16_t len; // compressed bytes
+	union {
+		uint32_t fill; // ZS_SAME
+		int16_t chunk; // first chunk of the compressed page
+	};
+};
+
+static struct zswap_entry *zswapTable; // one for each slot
+static char *pool;
+static int16_t chunkNext[ZS_NCHUNKS]; // next chunk of the same page, or free
+static int freeChunk = -1;
+static int nFreeChunks = 0;
+static int nEntries = 0; // pages in the pool, same-filled ones too
+static int hand = 0; // next slot looked at for write-back
+static int enabled = 1;
+
+// protects the table and the chunks; stores and write-backs also hold
+// zswap_store_lock, for the buffers below
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+static struct lock *zswap_store_lock;
+
+#define ZS_HASH_BITS 10
+#define ZS_NO_MATCH 0xffff
+static uint16_t matchHash[1 << ZS_HASH_BITS]; // last offset of each hash
+static uint8_t zbuf[ZSWAP_MAX_LEN]; // page being compressed
+static int wbFrame; // page being written back, decompressed
+
+/*
+ * The compressed format, LZ77 in the style of LZ4: a token below 0x80
+ * is followed by token + 1 literal bytes; 0x80 and above is a match of
+ * (token & 0x7f) + ZS_MIN_MATCH bytes, starting 1 + the next two bytes
+ * (little endian) back in the output.
+ */
+#define ZS_MIN_MATCH 4
+#define ZS_MAX_MATCH (0x7f + ZS_MIN_MATCH)
+#define ZS_MAX_LITERALS 0x80
+
+int zswap_bootstrap (void)
+{
+	paddr_t pa, wb;
+	int i;
+
+	zswapTable = kmalloc(sizeof(struct zswap_entry) * SWAP_TABLE_SIZE);
+	zswap_store_lock = lock_create("zswap");
+	pa = getppages(ZSWAP_POOL_PAGES);
+	wb = getppages(1);
+	if (zswapTable == NULL || zswap_store_lock == NULL || pa == 0 || wb == 0)
+		return ENOMEM;
+
+	pool = (char *)PADDR_TO_KVADDR(pa);
+	wbFrame = wb / PAGE_SIZE;
+
+	for (i = 0; i < SWAP_TABLE_SIZE; i++)
+		zswapTable[i].state = ZS_NONE;
+
+	for (i = 0; i < ZS_NCHUNKS; i++)
+		chunkNext[i] = (i == ZS_NCHUNKS - 1) ? -1 : i + 1;
+	freeChunk = 0;
+	nFreeChunks = ZS_NCHUNKS;
+
+	return 0;
+}
+
+// pages evicted from now on go (or not) through the pool, the ones
+// already there stay until they are read or freed
+void zswap_set_enabled (int on)
+{
+	enabled = on;
+}
+
+int zswap_is_enabled (void)
+{
+	return enabled;
+}
+
+static uint32_t zs_read32 (const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned zs_hash (uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - ZS_HASH_BITS);
+}
+
+// literals from lit to end, returns the new size of dst or -1 if full
+static int zs_literals (const uint8_t *lit, const uint8_t *end, uint8_t *dst, int out)
+{
+	int n;
+
+	while (lit < end)
+	{
+		n = end - lit;
+		if (n > ZS_MAX_LITERALS)
+			n = ZS_MAX_LITERALS;
+		if (out + 1 + n > ZSWAP_MAX_LEN)
+			return -1;
+
+		dst[out++] = n - 1;
+		memcpy(dst + out, lit, n);
+		out += n;
+		lit += n;
+	}
+
+	return out;
+}
+
+// Compresses a page into dst, returns its size or -1 if it doesn't fit
+// in ZSWAP_MAX_LEN. Greedy: the hash of the next 4 bytes finds the last
+// place they were seen, nothing more is searched.
+static int zs_compress (const uint8_t *src, uint8_t *dst)
+{
+	const uint8_t *end = src + PAGE_SIZE;
+	const uint8_t *ip = src, *lit = src, *ref;
+	unsigned h, len, dist;
+	uint32_t v;
+	int out = 0;
+
+	memset(matchHash, 0xff, sizeof(matchHash));
+
+	while (ip + ZS_MIN_MATCH <= end)
+	{
+		v = zs_read32(ip);
+		h = zs_hash(v);
+		ref = (matchHash[h] == ZS_NO_MATCH) ? NULL : src + matchHash[h];
+		matchHash[h] = ip - src;
+
+		if (ref == NULL || zs_read32(ref) != v)
+		{
+			ip++;
+			continue;
+		}
+
+		for (len = ZS_MIN_MATCH; len < ZS_MAX_MATCH && ip + len < end && ref[len] == ip[len]; len++);
+
+		out = zs_literals(lit, ip, dst, out);
+		if (out < 0 || out + 3 > ZSWAP_MAX_LEN)
+			return -1;
+
+		dist = ip - ref - 1;
+		dst[out++] = 0x80 | (len - ZS_MIN_MATCH);
+		dst[out++] = dist & 0xff;
+		dst[out++] = dist >> 8;
+
+		ip += len;
+		lit = ip;
+	}
+
+	return zs_literals(lit, end, dst, out);
+}
+
+// The following helpers are called with zswap_lock held
+
+static uint8_t zs_next_byte (int *chunk, unsigned *pos)
+{
+	if (*pos == ZSWAP_CHUNK)
+	{
+		*chunk = chunkNext[*chunk];
+		*pos = 0;
+	}
+
+	return pool[*chunk * ZSWAP_CHUNK + (*pos)++];
+}
+
+static void zs_decompress (const struct zswap_entry *e, uint8_t *dst)
+{
+	int chunk = e->chunk;
+	unsigned pos = 0, in = 0, out = 0, n, dist;
+	uint8_t token;
+
+	while (in < e->len)
+	{
+		token = zs_next_byte(&chunk, &pos);
+		if (token < 0x80)
+		{
+			n = token + 1;
+			in += 1 + n;
+			KASSERT(out + n <= PAGE_SIZE);
+			while (n-- > 0)
+				dst[out++] = zs_next_byte(&chunk, &pos);
+		}
+		else
+		{
+			n = (token & 0x7f) + ZS_MIN_MATCH;
+			dist = zs_next_byte(&chunk, &pos);
+			dist |= zs_next_byte(&chunk, &pos) << 8;
+			dist++;
+			in += 3;
+			KASSERT(dist <= out && out + n <= PAGE_SIZE);
+			// byte by byte: the match may overlap what it writes
+			for (; n > 0; n--, out++)
+				dst[out] = dst[out - dist];
+		}
+	}
+
+	KASSERT(out == PAGE_SIZE);
+}
+
+// a chain of n chunks, -1 if the pool hasn't enough room
+static int zs_alloc_chunks (int n)
+{
+	int first, last, i;
+
+	if (n > nFreeChunks)
+		return -1;
+
+	first = last = freeChunk;
+	for (i = 1; i < n; i++)
+		last = chunkNext[last];
+
+	freeChunk = chunkNext[last];
+	chunkNext[last] = -1;
+	nFreeChunks -= n;
+
+	return first;
+}
+
+static void zs_free_chunks (int first)
+{
+	int last, n = 1;
+
+	for (last = first; chunkNext[last] != -1; last = chunkNext[last])
+		n++;
+
+	chunkNext[last] = freeChunk;
+	freeChunk = first;
+	nFreeChunks += n;
+}
+
+static void zs_copy_in (int chunk, const uint8_t *src, unsigned len)
+{
+	unsigned n;
+
+	for (; len > 0; chunk = chunkNext[chunk])
+	{
+		n = (len < ZSWAP_CHUNK) ? len : ZSWAP_CHUNK;
+		memcpy(pool + chunk * ZSWAP_CHUNK, src, n);
+		src += n;
+		len -= n;
+	}
+}
+
+// End of the helpers called with zswap_lock held
+
+/*
+ * Makes room in the pool by writing a compressed page to its slot, with
+ * zswap_store_lock held. The hand sweeps the slots, which are mostly
+ * given out in order, so the pages that go are roughly the oldest ones.
+ * The page is still read from the pool while it's being written; if its
+ * slot is freed meanwhile, the slot is given back only at the end, so
+ * that it can't be reused before the write is over.
+ */
+static int zs_writeback (void)
+{
+	struct zswap_entry *e = NULL;
+	int i, index_sf = -1;
+	int result, dead;
+
+	spinlock_acquire(&zswap_lock);
+	for (i = 0; i < SWAP_TABLE_SIZE; i++)
+	{
+		index_sf = (hand + i) % SWAP_TABLE_SIZE;
+		if (zswapTable[index_sf].state == ZS_COMP)
+		{
+			e = &zswapTable[index_sf];
+			break;
+		}
+	}
+	if (e == NULL)
+	{
+		spinlock_release(&zswap_lock);
+		return ENOSPC;
+	}
+	hand = (index_sf + 1) % SWAP_TABLE_SIZE;
+	zs_decompress(e, (uint8_t *)PADDR_TO_KVADDR((paddr_t) wbFrame * PAGE_SIZE));
+	e->state = ZS_WRITEBACK;
+	spinlock_release(&zswap_lock);
+
+	result = swapfile_write_slot(index_sf, wbFrame);
+
+	spinlock_acquire(&zswap_lock);
+	dead = (e->state == ZS_DEAD);
+	if (result && !dead)
+	{
+		e->state = ZS_COMP;
+		spinlock_release(&zswap_lock);
+		return result;
+	}
+	zs_free_chunks(e->chunk);
+	e->state = ZS_NONE;
+	nEntries--;
+	spinlock_release(&zswap_lock);
+
+	if (dead)
+		swapfile_free_slot(index_sf);
+	else
+		increment_ZSWAP_writebacks();
+
+	return 0;
+}
+
+static int zs_same_filled (const uint32_t *page, uint32_t *fill)
+{
+	unsigned i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(uint32_t); i++)
+	{
+		if (page[i] != page[0])
+			return 0;
+	}
+
+	*fill = page[0];
+	return 1;
+}
+
+// Keeps the page in frame index_pt, being evicted to slot index_sf, in
+// the pool. Returns 0 if it's there, 1 if it must be written to the
+// device instead (the pool is off, the page doesn't compress or there's
+// no room even after a write-back).
+int zswap_store (int index_sf, int index_pt)
+{
+	const uint8_t *page = (const uint8_t *)PADDR_TO_KVADDR((paddr_t) index_pt * PAGE_SIZE);
+	struct zswap_entry *e = &zswapTable[index_sf];
+	uint32_t fill;
+	int len, chunk;
+
+	if (!enabled)
+		return 1;
+
+	if (zs_same_filled((const uint32_t *)page, &fill))
+	{
+		spinlock_acquire(&zswap_lock);
+		KASSERT(e->state == ZS_NONE);
+		e->state = ZS_SAME;
+		e->fill = fill;
+		nEntries++;
+		spinlock_release(&zswap_lock);
+		increment_ZSWAP_same();
+		return 0;
+	}
+
+	// a write-back that needs memory may evict pages itself
+	if (lock_do_i_hold(zswap_store_lock))
+		return 1;
+
+	vm_lock_acquire(zswap_store_lock);
+
+	len = zs_compress(page, zbuf);
+	if (len < 0)
+	{
+		vm_lock_release(zswap_store_lock);
+		increment_ZSWAP_rejects();
+		return 1;
+	}
+
+	spinlock_acquire(&zswap_lock);
+	while ((chunk = zs_alloc_chunks((len + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK)) < 0)
+	{
+		spinlock_release(&zswap_lock);
+		if (zs_writeback())
+		{
+			vm_lock_release(zswap_store_lock);
+			increment_ZSWAP_rejects();
+			return 1;
+		}
+		spinlock_acquire(&zswap_lock);
+	}
+	KASSERT(e->state == ZS_NONE);
+	zs_copy_in(chunk, zbuf, len);
+	e->state = ZS_COMP;
+	e->chunk = chunk;
+	e->len = len;
+	nEntries++;
+	spinlock_release(&zswap_lock);
+
+	vm_lock_release(zswap_store_lock);
+	record_ZSWAP_store(len);
+
+	return 0;
+}
+
+// Copies the page of slot index_sf into frame index_pt if it's in the
+// pool, returns 1 if so and 0 if it must be read from the device. The
+// copy in the pool is kept, like the slot.
+int zswap_load (int index_sf, int index_pt)
+{
+	uint32_t *page = (uint32_t *)PADDR_TO_KVADDR((paddr_t) index_pt * PAGE_SIZE);
+	struct zswap_entry *e = &zswapTable[index_sf];
+	unsigned i;
+	int found = 1;
+
+	spinlock_acquire(&zswap_lock);
+	switch (e->state)
+	{
+		case ZS_SAME:
+			for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+				page[i] = e->fill;
+			break;
+		case ZS_COMP:
+		case ZS_WRITEBACK:
+			zs_decompress(e, (uint8_t *)page);
+			break;
+		default:
+			found = 0;
+			break;
+	}
+	spinlock_release(&zswap_lock);
+
+	if (found)
+		increment_ZSWAP_hits();
+
+	return found;
+}
+
+// Slot index_sf is being freed, drops its page from the pool. Returns 1
+// if the slot must be kept until its write-back is over. Called with
+// the swapfile lock held.
+int zswap_invalidate (int index_sf)
+{
+	struct zswap_entry *e = &zswapTable[index_sf];
+	int busy = 0;
+
+	spinlock_acquire(&zswap_lock);
+	switch (e->state)
+	{
+		case ZS_COMP:
+			zs_free_chunks(e->chunk);
+			/* FALLTHROUGH */
+		case ZS_SAME:
+			e->state = ZS_NONE;
+			nEntries--;
+			break;
+		case ZS_WRITEBACK:
+			e->state = ZS_DEAD;
+			busy = 1;
+			break;
+	}
+	spinlock_release(&zswap_lock);
+
+	return busy;
+}
+
+void zswap_print_usage (void)
+{
+	int entries, used;
+
+	spinlock_acquire(&zswap_lock);
+	entries = nEntries;
+	used = ZS_NCHUNKS - nFreeChunks;
+	spinlock_release(&zswap_lock);
+
+	kprintf("zswap: %s, %d pages, %d/%d KB of the pool used\n",
+		enabled ? "on" : "off", entries, used * ZSWAP_CHUNK / 1024,
+		ZS_NCHUNKS * ZSWAP_CHUNK / 1024);
+}